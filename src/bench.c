@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <math.h>
+#include "image.h"
+#include "bench.h"
+#include "parallel.h"
+
+double what_time_is_it_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec*1e-9;
+}
+
+// A k x k filter with random taps, so it never takes the separable path.
+image make_random_filter(int k)
+{
+    image f = make_image(k, k, 1);
+    for (int i = 0; i < k*k; ++i) f.data[i] = rand()/(float)RAND_MAX - .5;
+    return f;
+}
+
+// Milliseconds per call of convolve_image, best of a few runs.
+double time_convolve(image im, image f, int runs)
+{
+    double best = 0;
+    for (int i = 0; i < runs; ++i) {
+        double start = what_time_is_it_now();
+        image out = convolve_image(im, f, 1);
+        double t = (what_time_is_it_now() - start)*1000;
+        if (i == 0 || t < best) best = t;
+        free_image(out);
+    }
+    return best;
+}
+
+// Time the direct and FFT convolution paths for growing square kernels to
+// find where the FFT starts to win.
+void bench_convolve()
+{
+    image color = load_image("data/dog.jpg");
+    image im = rgb_to_grayscale(color);
+    int sizes[] = {3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 25, 31, 37, 45};
+    int n = sizeof(sizes)/sizeof(sizes[0]);
+
+    printf("%dx%d grayscale, %d threads\n", im.w, im.h, get_num_threads());
+    printf("%8s %12s %12s\n", "kernel", "direct ms", "fft ms");
+    for (int i = 0; i < n; ++i) {
+        int k = sizes[i];
+        image f = make_random_filter(k);
+        set_fft_threshold(INT_MAX);
+        double direct = time_convolve(im, f, 3);
+        set_fft_threshold(1);
+        double fft = time_convolve(im, f, 3);
+        printf("%3dx%-4d %12.1f %12.1f\n", k, k, direct, fft);
+        free_image(f);
+    }
+    set_fft_threshold(0);
+
+    // Large blurs are separable, so they never need the FFT.
+    for (float sigma = 5; sigma <= 20; sigma *= 2) {
+        image g = make_gaussian_filter(sigma);
+        printf("gaussian sigma %4.1f (%dx%d) on color: %.1f ms\n", sigma, g.w, g.h, time_convolve(color, g, 1));
+        free_image(g);
+    }
+
+    free_image(im);
+    free_image(color);
+}
+
+// Time a filter bank against running its filters one at a time.
+void bench_bank()
+{
+    image color = load_image("data/dog_a.jpg");
+    image im = rgb_to_grayscale(color);
+    image f[4];
+    printf("%dx%d grayscale, %d threads\n", im.w, im.h, get_num_threads());
+    printf("%14s %12s %12s\n", "filters", "separate ms", "bank ms");
+    for (int k = 3; k <= 7; k += 2) {
+        for (int n = 2; n <= 4; n += 2) {
+            for (int i = 0; i < n; ++i) f[i] = make_random_filter(k);
+            double separate = 0, bank = 0;
+            for (int r = 0; r < 5; ++r) {
+                // Keep every output, like a caller of the bank has to.
+                image outs[4];
+                double start = what_time_is_it_now();
+                for (int i = 0; i < n; ++i) outs[i] = convolve_image(im, f[i], 1);
+                double t = (what_time_is_it_now() - start)*1000;
+                if (r == 0 || t < separate) separate = t;
+                for (int i = 0; i < n; ++i) free_image(outs[i]);
+
+                start = what_time_is_it_now();
+                image *out = convolve_bank(image_view(im), f, n, 1, BORDER_CLAMP);
+                t = (what_time_is_it_now() - start)*1000;
+                if (r == 0 || t < bank) bank = t;
+                for (int i = 0; i < n; ++i) free_image(out[i]);
+                free(out);
+            }
+            printf("%4d x %2dx%-4d %12.2f %12.2f\n", n, k, k, separate, bank);
+            for (int i = 0; i < n; ++i) free_image(f[i]);
+        }
+    }
+    free_image(im);
+    free_image(color);
+}
+
+// A normalized sampled Gaussian reaching 4 sigma, as the reference blur.
+image make_reference_gaussian(float sigma)
+{
+    int r = ceil(4*sigma);
+    image g = make_image(2*r + 1, 1, 1);
+    for (int x = -r; x <= r; ++x) g.data[x + r] = exp(-x*x/(2*sigma*sigma));
+    l1_normalize(g);
+    return g;
+}
+
+image reference_blur(image im, float sigma)
+{
+    image g = make_reference_gaussian(sigma);
+    image s1 = convolve_image(im, g, 1);
+    g.h = g.w;
+    g.w = 1;
+    image s2 = convolve_image(s1, g, 1);
+    free_image(g);
+    free_image(s1);
+    return s2;
+}
+
+// Largest and mean absolute difference, over the whole image and over the
+// part at least margin pixels away from the border.
+void print_error(image a, image b, int margin)
+{
+    double max = 0, sum = 0, inner_max = 0;
+    for (int c = 0; c < a.c; ++c) {
+        for (int y = 0; y < a.h; ++y) {
+            for (int x = 0; x < a.w; ++x) {
+                double d = fabs(PIXEL(a, x, y, c) - PIXEL(b, x, y, c));
+                sum += d;
+                if (d > max) max = d;
+                int inner = x >= margin && y >= margin && x < a.w - margin && y < a.h - margin;
+                if (inner && d > inner_max) inner_max = d;
+            }
+        }
+    }
+    printf(" %10.5f %10.5f %10.5f", max, sum/(a.w*a.h*a.c), inner_max);
+}
+
+// Compare both smooth_image modes against an exact Gaussian blur, for
+// accuracy and speed.
+void bench_smooth()
+{
+    image im = load_image("data/dog.jpg");
+    printf("%dx%dx%d, %d threads, errors are absolute on [0,1] pixels\n", im.w, im.h, im.c, get_num_threads());
+    printf("%6s %8s %10s %10s %10s %10s\n", "sigma", "mode", "ms", "max err", "mean err", "inner max");
+    for (float sigma = 1; sigma <= 32; sigma *= 2) {
+        image ref = reference_blur(im, sigma);
+        SMOOTH_MODE modes[] = {SMOOTH_EXACT, SMOOTH_RECURSIVE};
+        char *names[] = {"exact", "iir"};
+        for (int m = 0; m < 2; ++m) {
+            set_smooth_mode(modes[m]);
+            double start = what_time_is_it_now();
+            image s = smooth_image(im, sigma);
+            double ms = (what_time_is_it_now() - start)*1000;
+            printf("%6.1f %8s %10.1f", sigma, names[m], ms);
+            print_error(s, ref, 4*sigma);
+            printf("\n");
+            free_image(s);
+        }
+        free_image(ref);
+    }
+    set_smooth_mode(SMOOTH_EXACT);
+    free_image(im);
+}
+
+void run_bench(char *name)
+{
+    if (0 == strcmp(name, "convolve")) bench_convolve();
+    if (0 == strcmp(name, "smooth")) bench_smooth();
+    if (0 == strcmp(name, "bank")) bench_bank();
+}
@@ -0,0 +1,9 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+double what_time_is_it_now();
+void bench_convolve();
+void bench_smooth();
+void bench_bank();
+void run_bench(char *name);
+#endif
@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "image.h"
+#include "parallel.h"
+
+// Box filtering with running sums. A horizontal pass slides a window sum
+// along every row, then a vertical pass slides one down every column, so the
+// cost per pixel is the same for any window size. Sums are kept in doubles:
+// adding and subtracting floats is then exact enough that no error builds up
+// along a line, unlike the float summed area table in make_integral_image.
+//
+// The output may be the input image itself. Rows are copied into a padded
+// buffer before they are overwritten, and the vertical pass keeps the rows it
+// still has to subtract in a ring of fh rows.
+
+typedef struct{
+    view im;
+    image out;
+    int fw, fh;
+    float scale;
+    BORDER border;
+    int *cols;      // source offset of padded column i, -1 for zeros
+    int *enter;     // source row entering the window at step j, -1 for zeros
+    int *late;      // copy slot of rows that enter after being overwritten
+    int nlate;
+} box_args;
+
+void box_rows(void *, int, int);
+void box_columns(void *, int, int, int, int);
+
+// Slide a fw wide sum along rows [start, end) of all channels stacked on top
+// of each other.
+void box_rows(void *ptr, int start, int end)
+{
+    box_args *args = ptr;
+    view im = args->im;
+    int n = im.w + args->fw - 1;
+    float *pad = calloc(n, sizeof(float));
+    for (int r = start; r < end; r++) {
+        int c = r / im.h;
+        int y = r % im.h;
+        float *in = view_row(im, y, c);
+        float *out = image_row(args->out, y, c);
+        for (int i = 0; i < n; i++) pad[i] = args->cols[i] < 0 ? 0 : in[args->cols[i]];
+
+        double sum = 0;
+        for (int i = 0; i < args->fw - 1; i++) sum += pad[i];
+        for (int x = 0; x < im.w; x++) {
+            sum += pad[x + args->fw - 1];
+            out[x] = sum;
+            sum -= pad[x];
+        }
+    }
+    free(pad);
+}
+
+// Slide a fh tall sum down columns [x0, x1) of channels [c0, c1) of the
+// output, in place.
+void box_columns(void *ptr, int x0, int c0, int x1, int c1)
+{
+    box_args *args = ptr;
+    image out = args->out;
+    int fh = args->fh;
+    int n = x1 - x0;
+    double *acc = calloc(n, sizeof(double));
+    float *ring = calloc(fh * n, sizeof(float));
+    float *late = calloc(args->nlate * n, sizeof(float));
+
+    for (int c = c0; c < c1; c++) {
+        for (int j = 0; j < out.h + fh - 1; j++) {
+            if (args->late[j] >= 0) {
+                memcpy(late + args->late[j]*n, image_row(out, args->enter[j], c) + x0, n*sizeof(float));
+            }
+        }
+        memset(acc, 0, n*sizeof(double));
+
+        // Step j brings in one row, after which output row j - fh + 1 holds
+        // its whole window.
+        for (int j = 0; j < out.h + fh - 1; j++) {
+            float *slot = ring + (j % fh)*n;
+            if (j >= fh) {
+                for (int i = 0; i < n; i++) acc[i] -= slot[i];
+            }
+            const float *in = 0;
+            if (args->late[j] >= 0) in = late + args->late[j]*n;
+            else if (args->enter[j] >= 0) in = image_row(out, args->enter[j], c) + x0;
+            if (in) {
+                for (int i = 0; i < n; i++) {
+                    slot[i] = in[i];
+                    acc[i] += in[i];
+                }
+            } else {
+                memset(slot, 0, n*sizeof(float));
+            }
+
+            int y = j - fh + 1;
+            if (y < 0) continue;
+            float *dst = image_row(out, y, c) + x0;
+            for (int i = 0; i < n; i++) dst[i] = acc[i] * args->scale;
+        }
+    }
+    free(acc);
+    free(ring);
+    free(late);
+}
+
+// Sum every fw x fh window of an image in constant time per pixel.
+// view im: image to filter.
+// image out: im.w x im.h x im.c result, may be the image im looks at.
+// int fw, fh: window size, centered like a filter of the same size.
+// float scale: factor applied to every sum, 1/(fw*fh) for a mean.
+// BORDER border: how pixels past the edges read.
+void box_sum(view im, image out, int fw, int fh, float scale, BORDER border)
+{
+    assert(out.w == im.w && out.h == im.h && out.c == im.c);
+    box_args args = {0};
+    args.im = im;
+    args.out = out;
+    args.fw = fw;
+    args.fh = fh;
+    args.scale = scale;
+    args.border = border;
+
+    args.cols = calloc(im.w + fw - 1, sizeof(int));
+    for (int i = 0; i < im.w + fw - 1; i++) {
+        int x = border_index(i - fw/2, im.w, border);
+        args.cols[i] = x < 0 ? -1 : x * im.xs;
+    }
+
+    // Step j reads row j - fh/2 after output rows up to j - fh are written,
+    // so rows the border sends back above that need a copy first.
+    int steps = im.h + fh - 1;
+    args.enter = calloc(steps, sizeof(int));
+    args.late = calloc(steps, sizeof(int));
+    for (int j = 0; j < steps; j++) {
+        args.enter[j] = border_index(j - fh/2, im.h, border);
+        args.late[j] = args.enter[j] >= 0 && args.enter[j] <= j - fh ? args.nlate++ : -1;
+    }
+
+    parallel_for(im.h * im.c, box_rows, &args);
+    parallel_for_2d(im.w, im.c, 256, 1, box_columns, &args);
+
+    free(args.cols);
+    free(args.enter);
+    free(args.late);
+}
@@ -0,0 +1,229 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <complex.h>
+#include "image.h"
+#include "parallel.h"
+
+// Convolution through the frequency domain, for kernels too big to loop
+// over directly. Images are padded to a power of two at least w + fw - 1
+// wide and h + fh - 1 tall, with the padding filled according to the border
+// mode, so the circular product never wraps into the pixels we keep and the
+// result matches the direct loop up to rounding.
+//
+// 2d transforms are real to complex: every row goes through a half length
+// complex FFT, which leaves only n/2 + 1 columns to transform.
+
+typedef double complex cpx;
+
+typedef struct{
+    int w, h;       // padded size, powers of two
+    int cw;         // complex columns, w/2 + 1
+    cpx *row_tw;    // twiddles for the half length row FFT
+    cpx *col_tw;    // twiddles for the column FFT
+    cpx *split;     // e^(-2 pi i k / w), k in [0, w/2], for splitting rows
+    cpx *data;      // h x cw spectrum
+} fft_plan;
+
+typedef struct{
+    fft_plan *p;
+    float *real;    // h x w real plane
+    int inverse;
+} fft_args;
+
+void fft_rows(void *, int, int);
+void fft_columns(void *, int, int);
+
+int next_pow2(int n)
+{
+    int p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+// Twiddles e^(-2 pi i k / n) for k in [0, n/2).
+cpx *make_twiddles(int n)
+{
+    cpx *tw = calloc(n/2 + 1, sizeof(cpx));
+    for (int k = 0; k < n/2; k++) tw[k] = cexp(-2 * M_PI * I * k / n);
+    return tw;
+}
+
+// In place iterative radix 2 FFT.
+// cpx *x: n values, n a power of two.
+// cpx *tw: twiddles from make_twiddles(n).
+// int inverse: run the unnormalized inverse transform.
+void fft(cpx *x, int n, cpx *tw, int inverse)
+{
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) {
+            cpx t = x[i];
+            x[i] = x[j];
+            x[j] = t;
+        }
+    }
+    for (int len = 2; len <= n; len <<= 1) {
+        int step = n / len;
+        for (int i = 0; i < n; i += len) {
+            for (int k = 0; k < len/2; k++) {
+                cpx w = inverse ? conj(tw[k*step]) : tw[k*step];
+                cpx u = x[i + k];
+                cpx v = x[i + k + len/2] * w;
+                x[i + k] = u + v;
+                x[i + k + len/2] = u - v;
+            }
+        }
+    }
+}
+
+// Forward or inverse transform of rows [start, end) of the plan.
+void fft_rows(void *ptr, int start, int end)
+{
+    fft_args *args = ptr;
+    fft_plan *p = args->p;
+    int n = p->w / 2;
+    cpx *z = calloc(n + 1, sizeof(cpx));
+    for (int y = start; y < end; y++) {
+        float *x = args->real + y * p->w;
+        cpx *X = p->data + y * p->cw;
+        if (!args->inverse) {
+            // Pack even and odd samples into one complex signal.
+            for (int k = 0; k < n; k++) z[k] = x[2*k] + I * x[2*k + 1];
+            fft(z, n, p->row_tw, 0);
+            z[n] = z[0];
+            for (int k = 0; k <= n; k++) {
+                cpx even = (z[k] + conj(z[n - k])) / 2;
+                cpx odd = (z[k] - conj(z[n - k])) / (2 * I);
+                X[k] = even + p->split[k] * odd;
+            }
+        } else {
+            for (int k = 0; k < n; k++) {
+                cpx even = (X[k] + conj(X[n - k])) / 2;
+                cpx odd = (X[k] - conj(X[n - k])) * conj(p->split[k]) / 2;
+                z[k] = even + I * odd;
+            }
+            fft(z, n, p->row_tw, 1);
+            // The half length inverse leaves a factor of n, the columns
+            // leave a factor of h.
+            double scale = 1.0 / ((double)n * p->h);
+            for (int k = 0; k < n; k++) {
+                x[2*k] = creal(z[k]) * scale;
+                x[2*k + 1] = cimag(z[k]) * scale;
+            }
+        }
+    }
+    free(z);
+}
+
+// Transform columns [start, end) of the spectrum through a contiguous buffer.
+void fft_columns(void *ptr, int start, int end)
+{
+    fft_args *args = ptr;
+    fft_plan *p = args->p;
+    cpx *col = calloc(p->h, sizeof(cpx));
+    for (int x = start; x < end; x++) {
+        for (int y = 0; y < p->h; y++) col[y] = p->data[y * p->cw + x];
+        fft(col, p->h, p->col_tw, args->inverse);
+        for (int y = 0; y < p->h; y++) p->data[y * p->cw + x] = col[y];
+    }
+    free(col);
+}
+
+fft_plan make_fft_plan(int w, int h)
+{
+    fft_plan p;
+    p.w = MAX(next_pow2(w), 2);
+    p.h = next_pow2(h);
+    p.cw = p.w/2 + 1;
+    p.row_tw = make_twiddles(p.w/2);
+    p.col_tw = make_twiddles(p.h);
+    p.split = calloc(p.cw, sizeof(cpx));
+    for (int k = 0; k < p.cw; k++) p.split[k] = cexp(-2 * M_PI * I * k / p.w);
+    p.data = calloc(p.h * p.cw, sizeof(cpx));
+    return p;
+}
+
+void free_fft_plan(fft_plan p)
+{
+    free(p.row_tw);
+    free(p.col_tw);
+    free(p.split);
+    free(p.data);
+}
+
+// 2d real to complex transform of a p->w x p->h plane into p->data.
+void forward_fft2(fft_plan *p, float *real)
+{
+    fft_args args = {p, real, 0};
+    parallel_for(p->h, fft_rows, &args);
+    parallel_for(p->cw, fft_columns, &args);
+}
+
+// Inverse of forward_fft2, overwrites p->data.
+void inverse_fft2(fft_plan *p, float *real)
+{
+    fft_args args = {p, real, 1};
+    parallel_for(p->cw, fft_columns, &args);
+    parallel_for(p->h, fft_rows, &args);
+}
+
+// Convolve every channel of an image with a filter using FFTs.
+// view im: image to filter.
+// image filter: filter, either one channel or one per image channel.
+// BORDER border: how pixels past the edges read.
+// returns: filtered image with im.c channels, same as convolve_view_border
+//          with preserve set.
+image convolve_fft(view im, image filter, BORDER border)
+{
+    image out = make_temp_image(im.w, im.h, im.c);
+    fft_plan p = make_fft_plan(im.w + filter.w - 1, im.h + filter.h - 1);
+    int sx = filter.w / 2;
+    int sy = filter.h / 2;
+    float *real = calloc(p.w * p.h, sizeof(float));
+    cpx *spectrum = calloc(p.h * p.cw, sizeof(cpx));
+
+    int fc = -1;
+    for (int c = 0; c < im.c; c++) {
+        int k = (filter.c == im.c) ? c : 0;
+        if (k != fc) {
+            // The filter is correlated, not flipped, so keep its conjugate
+            // spectrum and place tap (fx, fy) at (fx, fy).
+            memset(real, 0, p.w * p.h * sizeof(float));
+            for (int fy = 0; fy < filter.h; fy++) {
+                memcpy(real + fy * p.w, image_row(filter, fy, k), filter.w * sizeof(float));
+            }
+            forward_fft2(&p, real);
+            for (int i = 0; i < p.h * p.cw; i++) spectrum[i] = conj(p.data[i]);
+            fc = k;
+        }
+
+        // Padded pixel (x, y) holds im(x - sx, y - sy) extended past the
+        // edges, so output pixel (x, y) lands at (x, y) of the correlation.
+        memset(real, 0, p.w * p.h * sizeof(float));
+        for (int y = 0; y < im.h + filter.h - 1; y++) {
+            int row = border_index(y - sy, im.h, border);
+            if (row < 0) continue;
+            float *src = view_row(im, row, c);
+            float *dst = real + y * p.w;
+            for (int x = 0; x < im.w + filter.w - 1; x++) {
+                int col = border_index(x - sx, im.w, border);
+                dst[x] = col < 0 ? 0 : src[col * im.xs];
+            }
+        }
+        forward_fft2(&p, real);
+        for (int i = 0; i < p.h * p.cw; i++) p.data[i] *= spectrum[i];
+        inverse_fft2(&p, real);
+
+        for (int y = 0; y < im.h; y++) {
+            memcpy(image_row(out, y, c), real + y * p.w, im.w * sizeof(float));
+        }
+    }
+
+    free(real);
+    free(spectrum);
+    free_fft_plan(p);
+    return out;
+}
@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "image.h"
+
+// Filters that are built over and over with the same arguments, like the
+// Gaussian smooth_image makes for every frame, are built once here and then
+// shared. Each entry is keyed by its type and by the arguments that type
+// uses, the others are zeroed so they never split a key.
+//
+// Lookups hold a lock, so any thread may ask for a filter. Cached filters
+// are built and freed with plain calloc and free, bypassing the image pool:
+// the pool is not thread safe, and a filter outlives whatever pool was
+// active when it was first asked for.
+
+image make_1d_gaussian(float sigma);
+void bypass_image_pool(int on);
+
+typedef struct{
+    FILTER_TYPE type;
+    float sigma;
+    int size;
+    image filter;
+} filter_entry;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static filter_entry *entries = 0;
+static int n_entries = 0, size_entries = 0;
+
+image build_filter(FILTER_TYPE type, float sigma, int size)
+{
+    switch (type) {
+        case FILTER_BOX: return make_box_filter(size);
+        case FILTER_GAUSSIAN: return make_gaussian_filter(sigma);
+        case FILTER_GAUSSIAN_1D: return make_1d_gaussian(sigma);
+        case FILTER_GX: return make_gx_filter();
+        case FILTER_GY: return make_gy_filter();
+        case FILTER_HIGHPASS: return make_highpass_filter();
+        case FILTER_SHARPEN: return make_sharpen_filter();
+        case FILTER_EMBOSS: return make_emboss_filter();
+    }
+    image none = {0};
+    return none;
+}
+
+// Get a filter from the cache, building it the first time it is asked for.
+// FILTER_TYPE type: which make_*_filter builds it.
+// float sigma: std dev. of the Gaussian types, ignored by the others.
+// int size: width of FILTER_BOX, ignored by the others.
+// returns: the filter, owned by the cache. Do not free or modify it.
+image get_filter(FILTER_TYPE type, float sigma, int size)
+{
+    int gaussian = type == FILTER_GAUSSIAN || type == FILTER_GAUSSIAN_1D;
+    if (!gaussian) sigma = 0;
+    if (type != FILTER_BOX) size = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < n_entries; i++) {
+        filter_entry e = entries[i];
+        if (e.type == type && e.sigma == sigma && e.size == size) {
+            pthread_mutex_unlock(&cache_lock);
+            return e.filter;
+        }
+    }
+    if (n_entries == size_entries) {
+        size_entries = size_entries ? 2*size_entries : 16;
+        entries = realloc(entries, size_entries * sizeof(filter_entry));
+    }
+    bypass_image_pool(1);
+    filter_entry e = {type, sigma, size, build_filter(type, sigma, size)};
+    bypass_image_pool(0);
+    entries[n_entries++] = e;
+    pthread_mutex_unlock(&cache_lock);
+    return e.filter;
+}
+
+// Free every cached filter. Filters handed out before are no longer valid.
+void free_filter_cache()
+{
+    pthread_mutex_lock(&cache_lock);
+    bypass_image_pool(1);
+    for (int i = 0; i < n_entries; i++) free_image(entries[i].filter);
+    bypass_image_pool(0);
+    free(entries);
+    entries = 0;
+    n_entries = size_entries = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,196 @@
+// Vectorized color conversion kernels, chosen at runtime by CPU support.
+// Each kernel works on n pixels of separate r, g, b rows and returns how many
+// it handled; the caller finishes the tail with the scalar code.
+#include "image.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define SIMD_TARGET_SSE4 __attribute__((target("sse4.1")))
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+
+SIMD_TARGET_SSE4 static int rgb_to_grayscale_sse4(const float *r, const float *g, const float *b, float *gray, int n)
+{
+    __m128 wr = _mm_set1_ps(0.299f), wg = _mm_set1_ps(0.587f), wb = _mm_set1_ps(0.114f);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_mul_ps(wr, _mm_loadu_ps(r + i));
+        v = _mm_add_ps(v, _mm_mul_ps(wg, _mm_loadu_ps(g + i)));
+        v = _mm_add_ps(v, _mm_mul_ps(wb, _mm_loadu_ps(b + i)));
+        _mm_storeu_ps(gray + i, v);
+    }
+    return i;
+}
+
+SIMD_TARGET_AVX2 static int rgb_to_grayscale_avx2(const float *r, const float *g, const float *b, float *gray, int n)
+{
+    __m256 wr = _mm256_set1_ps(0.299f), wg = _mm256_set1_ps(0.587f), wb = _mm256_set1_ps(0.114f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_mul_ps(wr, _mm256_loadu_ps(r + i));
+        v = _mm256_add_ps(v, _mm256_mul_ps(wg, _mm256_loadu_ps(g + i)));
+        v = _mm256_add_ps(v, _mm256_mul_ps(wb, _mm256_loadu_ps(b + i)));
+        _mm256_storeu_ps(gray + i, v);
+    }
+    return i;
+}
+
+// Hue is picked by which channel holds the max, in the same priority as
+// calc_hue (red, then green, then blue), using masks instead of branches.
+SIMD_TARGET_SSE4 static int rgb_to_hsv_sse4(float *r, float *g, float *b, int n)
+{
+    __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1), six = _mm_set1_ps(6);
+    __m128 two = _mm_set1_ps(2), four = _mm_set1_ps(4);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 R = _mm_loadu_ps(r + i), G = _mm_loadu_ps(g + i), B = _mm_loadu_ps(b + i);
+        __m128 V = _mm_max_ps(R, _mm_max_ps(G, B));
+        __m128 C = _mm_sub_ps(V, _mm_min_ps(R, _mm_min_ps(G, B)));
+        __m128 S = _mm_and_ps(_mm_div_ps(C, V), _mm_cmpneq_ps(V, zero));
+
+        __m128 is_r = _mm_cmpeq_ps(V, R), is_g = _mm_cmpeq_ps(V, G);
+        __m128 num = _mm_blendv_ps(_mm_sub_ps(R, G), _mm_sub_ps(B, R), is_g);
+        num = _mm_blendv_ps(num, _mm_sub_ps(G, B), is_r);
+        __m128 off = _mm_blendv_ps(four, two, is_g);
+        off = _mm_blendv_ps(off, zero, is_r);
+
+        __m128 H = _mm_div_ps(_mm_add_ps(_mm_div_ps(num, C), off), six);
+        H = _mm_add_ps(H, _mm_and_ps(one, _mm_cmplt_ps(H, zero)));
+        H = _mm_and_ps(H, _mm_cmpneq_ps(C, zero));
+
+        _mm_storeu_ps(r + i, H);
+        _mm_storeu_ps(g + i, S);
+        _mm_storeu_ps(b + i, V);
+    }
+    return i;
+}
+
+SIMD_TARGET_AVX2 static int rgb_to_hsv_avx2(float *r, float *g, float *b, int n)
+{
+    __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1), six = _mm256_set1_ps(6);
+    __m256 two = _mm256_set1_ps(2), four = _mm256_set1_ps(4);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 R = _mm256_loadu_ps(r + i), G = _mm256_loadu_ps(g + i), B = _mm256_loadu_ps(b + i);
+        __m256 V = _mm256_max_ps(R, _mm256_max_ps(G, B));
+        __m256 C = _mm256_sub_ps(V, _mm256_min_ps(R, _mm256_min_ps(G, B)));
+        __m256 S = _mm256_and_ps(_mm256_div_ps(C, V), _mm256_cmp_ps(V, zero, _CMP_NEQ_UQ));
+
+        __m256 is_r = _mm256_cmp_ps(V, R, _CMP_EQ_OQ), is_g = _mm256_cmp_ps(V, G, _CMP_EQ_OQ);
+        __m256 num = _mm256_blendv_ps(_mm256_sub_ps(R, G), _mm256_sub_ps(B, R), is_g);
+        num = _mm256_blendv_ps(num, _mm256_sub_ps(G, B), is_r);
+        __m256 off = _mm256_blendv_ps(four, two, is_g);
+        off = _mm256_blendv_ps(off, zero, is_r);
+
+        __m256 H = _mm256_div_ps(_mm256_add_ps(_mm256_div_ps(num, C), off), six);
+        H = _mm256_add_ps(H, _mm256_and_ps(one, _mm256_cmp_ps(H, zero, _CMP_LT_OQ)));
+        H = _mm256_and_ps(H, _mm256_cmp_ps(C, zero, _CMP_NEQ_UQ));
+
+        _mm256_storeu_ps(r + i, H);
+        _mm256_storeu_ps(g + i, S);
+        _mm256_storeu_ps(b + i, V);
+    }
+    return i;
+}
+
+// value - value*saturation*max(min(k, 4-k, 1), 0) with k = n + 6*hue wrapped
+// back below 6 exactly when the scalar while loop would wrap it.
+SIMD_TARGET_SSE4 static inline __m128 hsv_channel_sse4(float n, __m128 H6, __m128 S, __m128 V)
+{
+    __m128 six = _mm_set1_ps(6);
+    __m128 k = _mm_add_ps(_mm_set1_ps(n), H6);
+    __m128 wrapped = _mm_sub_ps(k, _mm_mul_ps(six, _mm_floor_ps(_mm_div_ps(k, six))));
+    k = _mm_blendv_ps(k, wrapped, _mm_cmpgt_ps(k, six));
+    __m128 t = _mm_min_ps(_mm_min_ps(k, _mm_sub_ps(_mm_set1_ps(4), k)), _mm_set1_ps(1));
+    t = _mm_max_ps(t, _mm_setzero_ps());
+    return _mm_sub_ps(V, _mm_mul_ps(_mm_mul_ps(V, S), t));
+}
+
+SIMD_TARGET_AVX2 static inline __m256 hsv_channel_avx2(float n, __m256 H6, __m256 S, __m256 V)
+{
+    __m256 six = _mm256_set1_ps(6);
+    __m256 k = _mm256_add_ps(_mm256_set1_ps(n), H6);
+    __m256 wrapped = _mm256_sub_ps(k, _mm256_mul_ps(six, _mm256_floor_ps(_mm256_div_ps(k, six))));
+    k = _mm256_blendv_ps(k, wrapped, _mm256_cmp_ps(k, six, _CMP_GT_OQ));
+    __m256 t = _mm256_min_ps(_mm256_min_ps(k, _mm256_sub_ps(_mm256_set1_ps(4), k)), _mm256_set1_ps(1));
+    t = _mm256_max_ps(t, _mm256_setzero_ps());
+    return _mm256_sub_ps(V, _mm256_mul_ps(_mm256_mul_ps(V, S), t));
+}
+
+SIMD_TARGET_SSE4 static int hsv_to_rgb_sse4(float *h, float *s, float *v, int n)
+{
+    __m128 six = _mm_set1_ps(6);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 H6 = _mm_mul_ps(_mm_loadu_ps(h + i), six);
+        __m128 S = _mm_loadu_ps(s + i), V = _mm_loadu_ps(v + i);
+        _mm_storeu_ps(h + i, hsv_channel_sse4(5, H6, S, V));
+        _mm_storeu_ps(s + i, hsv_channel_sse4(3, H6, S, V));
+        _mm_storeu_ps(v + i, hsv_channel_sse4(1, H6, S, V));
+    }
+    return i;
+}
+
+SIMD_TARGET_AVX2 static int hsv_to_rgb_avx2(float *h, float *s, float *v, int n)
+{
+    __m256 six = _mm256_set1_ps(6);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 H6 = _mm256_mul_ps(_mm256_loadu_ps(h + i), six);
+        __m256 S = _mm256_loadu_ps(s + i), V = _mm256_loadu_ps(v + i);
+        _mm256_storeu_ps(h + i, hsv_channel_avx2(5, H6, S, V));
+        _mm256_storeu_ps(s + i, hsv_channel_avx2(3, H6, S, V));
+        _mm256_storeu_ps(v + i, hsv_channel_avx2(1, H6, S, V));
+    }
+    return i;
+}
+
+// 0: scalar only, 1: SSE4.1, 2: AVX2. Negative means not detected yet.
+static int simd_level = -1;
+
+int color_simd_level()
+{
+    if (simd_level < 0) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) simd_level = 2;
+        else if (__builtin_cpu_supports("sse4.1")) simd_level = 1;
+        else simd_level = 0;
+    }
+    return simd_level;
+}
+
+int rgb_to_grayscale_simd(const float *r, const float *g, const float *b, float *gray, int n)
+{
+    switch (color_simd_level()) {
+        case 2: return rgb_to_grayscale_avx2(r, g, b, gray, n);
+        case 1: return rgb_to_grayscale_sse4(r, g, b, gray, n);
+        default: return 0;
+    }
+}
+
+int rgb_to_hsv_simd(float *r, float *g, float *b, int n)
+{
+    switch (color_simd_level()) {
+        case 2: return rgb_to_hsv_avx2(r, g, b, n);
+        case 1: return rgb_to_hsv_sse4(r, g, b, n);
+        default: return 0;
+    }
+}
+
+int hsv_to_rgb_simd(float *h, float *s, float *v, int n)
+{
+    switch (color_simd_level()) {
+        case 2: return hsv_to_rgb_avx2(h, s, v, n);
+        case 1: return hsv_to_rgb_sse4(h, s, v, n);
+        default: return 0;
+    }
+}
+
+#else
+
+int color_simd_level() { return 0; }
+int rgb_to_grayscale_simd(const float *r, const float *g, const float *b, float *gray, int n) { return 0; }
+int rgb_to_hsv_simd(float *r, float *g, float *b, int n) { return 0; }
+int hsv_to_rgb_simd(float *h, float *s, float *v, int n) { return 0; }
+
+#endif
@@ -3,11 +3,18 @@
 #include <assert.h>
 #include <math.h>
 #include "image.h"
+#include "parallel.h"
 
 #define get_index(im, x, y, c) ((x) + ((im).w * (y)) + ((im).w * (im).h * (c)))
 #define get_inbound(a, min, max) (((a) > max) ? max : (((a) < min) ? min : (a)))
 #define in_bounds(im, x, y, c) ((x) < (im).w && (y) < (im).h && (c) < (im).c)
 
+int rgb_to_grayscale_simd(const float *, const float *, const float *, float *, int);
+int rgb_to_hsv_simd(float *, float *, float *, int);
+int hsv_to_rgb_simd(float *, float *, float *, int);
+void rgb_to_hsv_rows(void *, int, int);
+void hsv_to_rgb_rows(void *, int, int);
+
 float get_pixel(image im, int x, int y, int c)
 {
     return im.data[get_index(im, get_inbound(x, 0, im.w - 1), get_inbound(y, 0, im.h - 1)
@@ -32,6 +39,21 @@ image rgb_to_grayscale(image im)
     assert(im.c == 3);
     image gray = make_image(im.w, im.h, 1);
 
+    float weights[] = { 0.299, 0.587, 0.114 };
+    int size = im.w * im.h;
+    float *r = image_row(im, 0, 0), *g = image_row(im, 0, 1), *b = image_row(im, 0, 2);
+
+    for (int i = rgb_to_grayscale_simd(r, g, b, gray.data, size); i < size; i++) {
+        gray.data[i] = weights[0] * r[i] + weights[1] * g[i] + weights[2] * b[i];
+    }
+    return gray;
+}
+
+image rgb_to_grayscale_scalar(image im)
+{
+    assert(im.c == 3);
+    image gray = make_image(im.w, im.h, 1);
+
     float weights[] = { 0.299, 0.587, 0.114 };
     int image_index = 0;
 
@@ -114,31 +136,55 @@ float calc_hue(float C, float V, float red, float green, float blue) {
     return hue;
 }
 
+void rgb_to_hsv_pixels(float *redPtr, float *greenPtr, float *bluePtr, int stride, int n)
+{
+    for (int i = 0; i < n; i++, redPtr += stride, greenPtr += stride, bluePtr += stride) {
+        float red = *redPtr;
+        float green = *greenPtr;
+        float blue = *bluePtr;
+
+        float min = three_way_min(red, green, blue);
+        float V = three_way_max(red, green, blue);
+        float C = V - min;
+        float S = V != 0 ? C / V : 0;
+        float H = C != 0 ? calc_hue(C, V, red, green, blue) : 0;
+
+        *bluePtr = V;
+        *greenPtr = S;
+        *redPtr = H;
+    }
+}
+
 void rgb_to_hsv(image im)
 {
-    for (int h = 0; h < im.h; h++) {
-        for (int w = 0; w < im.w; w++) {
-            int redIndex = get_index(im, w, h, 0);
-            int greenIndex = get_index(im, w, h, 1);
-            int blueIndex = get_index(im, w, h, 2);
-
-            float red = im.data[redIndex];
-            float green = im.data[greenIndex];
-            float blue = im.data[blueIndex];
-
-            float min = three_way_min(red, green, blue);
-            float V = three_way_max(red, green, blue);
-            float C = V - min;
-            float S = V != 0 ? C / V : 0;
-            float H = C != 0 ? calc_hue(C, V, red, green, blue) : 0;
-
-            im.data[blueIndex] = V;
-            im.data[greenIndex] = S;
-            im.data[redIndex] = H;
+    rgb_to_hsv_view(image_view(im));
+}
+
+void rgb_to_hsv_view(view im)
+{
+    parallel_for(im.h, rgb_to_hsv_rows, &im);
+}
+
+void rgb_to_hsv_rows(void *ptr, int start, int end)
+{
+    view im = *(view *)ptr;
+    for (int h = start; h < end; h++) {
+        float *r = view_row(im, h, 0), *g = view_row(im, h, 1), *b = view_row(im, h, 2);
+        // Padded rows let the vector loop run past w instead of leaving a tail.
+        int done = (im.xs == 1) ? rgb_to_hsv_simd(r, g, b, im.pw) : 0;
+        if (done < im.w) {
+            int offset = done * im.xs;
+            rgb_to_hsv_pixels(r + offset, g + offset, b + offset, im.xs, im.w - done);
         }
     }
 }
 
+void rgb_to_hsv_scalar(image im)
+{
+    int size = im.w * im.h;
+    rgb_to_hsv_pixels(image_row(im, 0, 0), image_row(im, 0, 1), image_row(im, 0, 2), 1, size);
+}
+
 float color(int n, float hue, float value, float saturation) {
     float k = n + hue * 6;
     while (k > 6) {
@@ -148,25 +194,49 @@ float color(int n, float hue, float value, float saturation) {
     return value - value * saturation * (min > 0 ? min : 0);
 }
 
-void hsv_to_rgb(image im)
+void hsv_to_rgb_pixels(float *huePtr, float *saturationPtr, float *valuePtr, int stride, int n)
 {
-    for (int h = 0; h < im.h; h++) {
-        for (int w = 0; w < im.w; w++) {
-            int hueIndex = get_index(im, w, h, 0);
-            int saturationIndex = get_index(im, w, h, 1);
-            int valueIndex = get_index(im, w, h, 2);
+    for (int i = 0; i < n; i++, huePtr += stride, saturationPtr += stride, valuePtr += stride) {
+        float hue = *huePtr;
+        float saturation = *saturationPtr;
+        float value = *valuePtr;
+
+        float red = color(5, hue, value, saturation);
+        float green = color(3, hue, value, saturation);
+        float blue = color(1, hue, value, saturation);
+
+        *huePtr = red;
+        *saturationPtr = green;
+        *valuePtr = blue;
+    }
+}
 
-            float hue = im.data[hueIndex];
-            float saturation = im.data[saturationIndex];
-            float value = im.data[valueIndex];
+void hsv_to_rgb(image im)
+{
+    hsv_to_rgb_view(image_view(im));
+}
 
-            float red = color(5, hue, value, saturation);
-            float green = color(3, hue, value, saturation);
-            float blue = color(1, hue, value, saturation);
+void hsv_to_rgb_view(view im)
+{
+    parallel_for(im.h, hsv_to_rgb_rows, &im);
+}
 
-            im.data[hueIndex] = red;
-            im.data[saturationIndex] = green;
-            im.data[valueIndex] = blue;
+void hsv_to_rgb_rows(void *ptr, int start, int end)
+{
+    view im = *(view *)ptr;
+    for (int h = start; h < end; h++) {
+        float *hue = view_row(im, h, 0), *sat = view_row(im, h, 1), *val = view_row(im, h, 2);
+        // Padded rows let the vector loop run past w instead of leaving a tail.
+        int done = (im.xs == 1) ? hsv_to_rgb_simd(hue, sat, val, im.pw) : 0;
+        if (done < im.w) {
+            int offset = done * im.xs;
+            hsv_to_rgb_pixels(hue + offset, sat + offset, val + offset, im.xs, im.w - done);
         }
     }
 }
+
+void hsv_to_rgb_scalar(image im)
+{
+    int size = im.w * im.h;
+    hsv_to_rgb_pixels(image_row(im, 0, 0), image_row(im, 0, 1), image_row(im, 0, 2), 1, size);
+}
@@ -103,19 +103,26 @@ float get_1d_gaussian_value(int x, float sigma) {
     return expo / scale;
 }
 
+static SMOOTH_MODE smooth_mode = SMOOTH_EXACT;
+
+// Choose how smooth_image blurs, see SMOOTH_MODE.
+void set_smooth_mode(SMOOTH_MODE mode)
+{
+    smooth_mode = mode;
+}
+
 // Smooths an image using separable Gaussian filter.
 // image im: image to smooth.
 // float sigma: std dev. for Gaussian.
 // returns: smoothed image.
 image smooth_image(image im, float sigma)
 {
-    if (0) {
-        image g = make_gaussian_filter(sigma);
-        image s = convolve_image(im, g, 1);
-        free_image(g);
-        return s;
+    if (smooth_mode == SMOOTH_RECURSIVE) {
+        return recursive_gaussian(im, sigma);
     } else {
-        image g = make_1d_gaussian(sigma);
+        // The cached taps are shared, only this copy of the header turns
+        // them into a column.
+        image g = get_filter(FILTER_GAUSSIAN_1D, sigma, 0);
         image s1 = convolve_image(im, g, 1);
 
         g.h = g.w;
@@ -123,7 +130,6 @@ image smooth_image(image im, float sigma)
 
         image s2 = convolve_image(s1, g, 1);
 
-        free_image(g);
         free_image(s1);
 
         return s2;
@@ -137,13 +143,21 @@ image smooth_image(image im, float sigma)
 //          third channel is IxIy.
 image structure_matrix(image im, float sigma)
 {
-    image gradient_x = make_gx_filter();
-    image gradient_y = make_gy_filter();
+    return structure_matrix_view(image_view(im), sigma);
+}
 
-    image image_gradient_x = convolve_image(im, gradient_x, 0);
-    image image_gradient_y = convolve_image(im, gradient_y, 0);
+// Calculate the structure matrix of a (possibly strided) view of an image.
+// view im: the input pixels.
+// float sigma: std dev. to use for weighted sum.
+// returns: structure matrix, same layout as structure_matrix.
+image structure_matrix_view(view im, float sigma)
+{
+    image image_gradient_x = make_temp_image(im.w, im.h, 1);
+    image image_gradient_y = make_temp_image(im.w, im.h, 1);
+    image none = {0};
+    sobel_gradients(im, image_gradient_x, image_gradient_y, none, none);
 
-    image structure = make_image(im.w, im.h, 3);
+    image structure = make_temp_image(im.w, im.h, 3);
 
     set_channel(structure, 0, image_gradient_x, image_gradient_x);
     set_channel(structure, 1, image_gradient_y, image_gradient_y);
@@ -151,8 +165,6 @@ image structure_matrix(image im, float sigma)
 
     image weighted_structure = smooth_image(structure, sigma);
 
-    free_image(gradient_x);
-    free_image(gradient_y);
     free_image(image_gradient_x);
     free_image(image_gradient_y);
     free_image(structure);
@@ -161,10 +173,10 @@ image structure_matrix(image im, float sigma)
 }
 
 void set_channel(image structure, int channel, image first, image second) {
-    for (int y = 0; y < structure.h; y++) {
-        for (int x = 0; x < structure.w; x++) {
-            set_pixel(structure, x, y, channel, get_pixel(first, x, y, 0) * get_pixel(second, x, y, 0));
-        }
+    int size = structure.w * structure.h;
+    float *out = image_row(structure, 0, channel);
+    for (int i = 0; i < size; i++) {
+        out[i] = first.data[i] * second.data[i];
     }
 }
 
@@ -175,12 +187,14 @@ image cornerness_response(image S)
 {
     image R = make_image(S.w, S.h, 1);
     float alpha = 0.06;
-    for (int y = 0; y < S.h; y++) {
-        for (int x = 0; x < S.w; x++) {
-            float det = get_pixel(S, x, y, 0) * get_pixel(S, x, y, 1) - pow(get_pixel(S, x, y, 2), 2);
-            float trace = get_pixel(S, x, y, 0) + get_pixel(S, x, y, 1);
-            set_pixel(R, x, y, 0, det - alpha * pow(trace, 2));
-        }
+    int size = S.w * S.h;
+    float *Ixx = image_row(S, 0, 0);
+    float *Iyy = image_row(S, 0, 1);
+    float *Ixy = image_row(S, 0, 2);
+    for (int i = 0; i < size; i++) {
+        float det = Ixx[i] * Iyy[i] - Ixy[i] * Ixy[i];
+        float trace = Ixx[i] + Iyy[i];
+        R.data[i] = det - alpha * trace * trace;
     }
     return R;
 }
@@ -193,8 +207,9 @@ image nms_image(image im, int w)
 {
     image nms = copy_image(im);
     for (int y = 0; y < im.h; y++) {
+        float *row = image_row(nms, y, 0);
         for (int x = 0; x < im.w; x++) {
-            if (get_pixel(nms, x, y, 0) != -999999) {
+            if (row[x] != -999999) {
                 suppress_pixel(im, nms, y, x, w);
             }
         }
@@ -202,18 +217,26 @@ image nms_image(image im, int w)
     return nms;
 }
 
+// Reading outside the image would only repeat edge pixels, and writing
+// there is a no-op, so the window is clipped to the image once up front.
 void suppress_pixel(image im, image nms, int r, int c, int w) {
-    float max_val = get_pixel(im, c, r, 0);
-    for (int y = r - w; y <= r + w; y++) {
-        for (int x = c - w; x <= c + w; x++) {
-            max_val = max_val >= get_pixel(im, x, y, 0) ? max_val : get_pixel(im, x, y, 0);
+    int y0 = MAX(r - w, 0), y1 = MIN(r + w, im.h - 1);
+    int x0 = MAX(c - w, 0), x1 = MIN(c + w, im.w - 1);
+
+    float max_val = PIXEL(im, c, r, 0);
+    for (int y = y0; y <= y1; y++) {
+        float *row = image_row(im, y, 0);
+        for (int x = x0; x <= x1; x++) {
+            max_val = max_val >= row[x] ? max_val : row[x];
         }
     }
 
-    for (int y = r - w; y <= r + w; y++) {
-        for (int x = c - w; x <= c + w; x++) {
-            if (get_pixel(im, x, y, 0) < max_val) {
-                set_pixel(nms, x, y, 0, -999999);
+    for (int y = y0; y <= y1; y++) {
+        float *row = image_row(im, y, 0);
+        float *out = image_row(nms, y, 0);
+        for (int x = x0; x <= x1; x++) {
+            if (row[x] < max_val) {
+                out[x] = -999999;
             }
         }
     }
@@ -238,12 +261,11 @@ descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms,
     image Rnms = nms_image(R, nms);
 
     int count = 0; // change this
+    int size = Rnms.w * Rnms.h;
 
-    for (int y = 0; y < Rnms.h; y++) {
-        for (int x = 0; x < Rnms.w; x++) {
-            if (get_pixel(Rnms, x, y, 0) > thresh) {
-                count++;
-            }
+    for (int i = 0; i < size; i++) {
+        if (Rnms.data[i] > thresh) {
+            count++;
         }
     }
 
@@ -252,11 +274,9 @@ descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms,
     descriptor *d = calloc(count, sizeof(descriptor));
 
     int index = 0;
-    for (int y = 0; y < Rnms.h; y++) {
-        for (int x = 0; x < Rnms.w; x++) {
-            if (get_pixel(Rnms, x, y, 0) > thresh) {
-                d[index++] = describe_index(im, y * Rnms.w + x);
-            }
+    for (int i = 0; i < size; i++) {
+        if (Rnms.data[i] > thresh) {
+            d[index++] = describe_index(im, i);
         }
     }
 
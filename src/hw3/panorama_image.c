@@ -5,8 +5,11 @@
 #include <assert.h>
 #include "image.h"
 #include "matrix.h"
+#include "parallel.h"
 
 void swap(match*, int, int);
+void combine_rows(void *, int, int);
+void cylinder_rows(void *, int, int);
 
 // Comparator for matches
 // const void *a, *b: pointers to the matches to compare.
@@ -36,21 +39,9 @@ point make_point(float x, float y)
 image both_images(image a, image b)
 {
     image both = make_image(a.w + b.w, a.h > b.h ? a.h : b.h, a.c > b.c ? a.c : b.c);
-    int i,j,k;
-    for(k = 0; k < a.c; ++k){
-        for(j = 0; j < a.h; ++j){
-            for(i = 0; i < a.w; ++i){
-                set_pixel(both, i, j, k, get_pixel(a, i, j, k));
-            }
-        }
-    }
-    for(k = 0; k < b.c; ++k){
-        for(j = 0; j < b.h; ++j){
-            for(i = 0; i < b.w; ++i){
-                set_pixel(both, i+a.w, j, k, get_pixel(b, i, j, k));
-            }
-        }
-    }
+    view canvas = image_view(both);
+    copy_view(image_view(a), crop_view(canvas, 0, 0, a.w, a.h));
+    copy_view(image_view(b), crop_view(canvas, a.w, 0, b.w, b.h));
     return both;
 }
 
@@ -326,6 +317,45 @@ matrix RANSAC(match *matches, int n, float thresh, int k, int cutoff)
     return Hb;
 }
 
+// Work shared by the threads that warp b in combine_images.
+typedef struct{
+    view src;
+    image out;
+    matrix H;
+    int dx, dy;
+    float x0, x1;
+    int y0;
+} combine_args;
+
+// Warp rows [start, end) of b, counted from args->y0, onto the canvas.
+void combine_rows(void *ptr, int start, int end)
+{
+    combine_args *args = ptr;
+    view src = args->src;
+    image c = args->out;
+    matrix H = args->H;
+
+    // Project each pixel once for all channels, without allocating matrices.
+    double h00 = H.data[0][0], h01 = H.data[0][1], h02 = H.data[0][2];
+    double h10 = H.data[1][0], h11 = H.data[1][1], h12 = H.data[1][2];
+    double h20 = H.data[2][0], h21 = H.data[2][1], h22 = H.data[2][2];
+
+    for (int j = args->y0 + start; j < args->y0 + end; ++j) {
+        for (int i = args->x0; i < args->x1; ++i) {
+            if (i - args->dx < 0 || i - args->dx >= c.w) continue;
+            double z = h20 * i + h21 * j + h22;
+            float px = (h00 * i + h01 * j + h02) / z;
+            float py = (h10 * i + h11 * j + h12) / z;
+
+            if (px >= 0 && px < src.w && py >= 0 && py < src.h) {
+                for (int k = 0; k < c.c; ++k) {
+                    PIXEL(c, i - args->dx, j - args->dy, k) = bilinear_interpolate_view(src, px, py, k);
+                }
+            }
+        }
+    }
+}
+
 // Stitches two images together using a projective transformation.
 // image a, b: images to stitch.
 // matrix H: homography from image a coordinates to image b coordinates.
@@ -360,30 +390,19 @@ image combine_images(image a, image b, matrix H)
     //     return copy_image(a);
     // }
 
-    int i, j, k;
     image c = make_image(w, h, a.c);
 
-    for (k = 0; k < a.c; ++k) {
-        for (j = 0; j < a.h; ++j) {
-            for (i = 0; i < a.w; ++i) {
-                set_pixel(c, i - dx, j - dy, k, get_pixel(a, i, j, k));
-            }
-        }
-    }
+    view canvas = image_view(c);
+    copy_view(image_view(a), crop_view(canvas, -dx, -dy, a.w, a.h));
 
-    for (k = 0; k < a.c; ++k) {
-        for (j = topleft.y; j < botright.y; ++j) {
-            for (i = topleft.x; i < botright.x; ++i) {
-                point p = project_point(H, make_point(i, j));
+    // Rows of the warped b that land on the canvas, in image a coordinates.
+    int y0 = MAX((int)topleft.y, dy);
+    int y1 = MAX(y0, (int)MIN(ceil(botright.y), dy + h));
 
-                if (p.x >= 0 && p.x < b.w && p.y >= 0 && p.y < b.h) {
-                    float val = bilinear_interpolate(b, p.x, p.y, k);
-                    set_pixel(c, i - dx, j - dy, k, val);
-                }
-            }
-        }
-    }
+    combine_args args = {image_view(b), c, H, dx, dy, topleft.x, botright.x, y0};
+    parallel_for(y1 - y0, combine_rows, &args);
 
+    free_matrix(Hinv);
     return c;
 }
 
@@ -429,19 +448,25 @@ image panorama_image(image a, image b, float sigma, float thresh, int nms, float
     return comb;
 }
 
-// Project an image onto a cylinder.
-// image im: image to project.
-// float f: focal length used to take image (in pixels).
-// returns: image projected onto cylinder, then flattened.
-image cylindrical_project(image im, float f)
-{
-    int xc = im.w / 2;
-    int yc = im.h / 2;
-    int w = 2 * f * atan2(xc, f) - 1;
+// Work shared by the threads that project rows in cylindrical_project.
+typedef struct{
+    view src;
+    image out;
+    float f;
+} cylinder_args;
 
-    image project_image = make_image(w, im.h, im.c);
-
-    for (int i = -yc; i < im.h - yc; i++) {
+// Project output rows [start, end) onto the cylinder.
+void cylinder_rows(void *ptr, int start, int end)
+{
+    cylinder_args *args = ptr;
+    view src = args->src;
+    image out = args->out;
+    float f = args->f;
+    int xc = src.w / 2;
+    int yc = src.h / 2;
+    int w = out.w;
+
+    for (int i = start - yc; i < end - yc; i++) {
         for (int j = -w / 2; j <= w / 2; j++) {
             float theta = j / f;
             float height = i / f;
@@ -449,14 +474,27 @@ image cylindrical_project(image im, float f)
             float x_ = f * sin(theta) / cos(theta) + xc;
             float y_ = f * height / cos(theta) + yc;
 
-            if (x_ >= 0 && x_ < im.w && y_ >= 0 && y_ < im.h) {
-                for (int c = 0; c < im.c; c++) {
-                    float val = bilinear_interpolate(im, x_, y_, c);
-                    set_pixel(project_image, j + w / 2, i + yc, c, val);
+            if (x_ >= 0 && x_ < src.w && y_ >= 0 && y_ < src.h && j + w / 2 < w) {
+                for (int c = 0; c < src.c; c++) {
+                    PIXEL(out, j + w / 2, i + yc, c) = bilinear_interpolate_view(src, x_, y_, c);
                 }
             }
         }
     }
+}
+
+// Project an image onto a cylinder.
+// image im: image to project.
+// float f: focal length used to take image (in pixels).
+// returns: image projected onto cylinder, then flattened.
+image cylindrical_project(image im, float f)
+{
+    int xc = im.w / 2;
+    int w = 2 * f * atan2(xc, f) - 1;
+
+    image project_image = make_image(w, im.h, im.c);
+    cylinder_args args = {image_view(im), project_image, f};
+    parallel_for(im.h, cylinder_rows, &args);
 
     return project_image;
 }
@@ -5,8 +5,12 @@
 #include <assert.h>
 #include "image.h"
 #include "matrix.h"
+#include "parallel.h"
 
 image* image_gradients(image);
+void integral_rows(void *, int, int);
+void integral_columns(void *, int, int, int, int);
+void velocity_rows(void *, int, int);
 
 // Draws a line on an image with color corresponding to the direction of line
 // image im: image to draw line on
@@ -43,69 +47,64 @@ void draw_line(image im, float x, float y, float dx, float dy)
     }
 }
 
+typedef struct{
+    image im;
+    image integ;
+} integral_args;
+
 // Make an integral image or summed area table from an image
 // image im: image to process
 // returns: image I such that I[x,y] = sum{i<=x, j<=y}(im[i,j])
 image make_integral_image(image im)
 {
-    image integ = make_image(im.w, im.h, im.c);
-    for (int c = 0; c < im.c; c++) {
-        for (int h = 0; h < im.h; h++) {
-            for (int w = 0; w < im.w; w++) {
-                float val = get_pixel(im, w, h, c);
-                if (w > 0) {
-                    val += get_pixel(integ, w - 1, h, c);
-                }
-                if (h > 0) {
-                    val += get_pixel(integ, w, h - 1, c);
-                }
-                if (h > 0 && w > 0) {
-                    val -= get_pixel(integ, w - 1, h - 1, c);
-                }
-                set_pixel(integ, w, h, c, val);
+    image integ = make_temp_image(im.w, im.h, im.c);
+    integral_args args = {im, integ};
+    // Rows are summed independently, then each column band accumulates
+    // downwards. The additions happen in the same order as a serial pass.
+    parallel_for(im.h * im.c, integral_rows, &args);
+    parallel_for_2d(im.w, im.c, 256, 1, integral_columns, &args);
+    return integ;
+}
+
+// Prefix sum rows [start, end) of all channels stacked on top of each other.
+void integral_rows(void *ptr, int start, int end)
+{
+    integral_args *args = ptr;
+    for (int r = start; r < end; r++) {
+        float *in = args->im.data + r * args->im.w;
+        float *out = args->integ.data + r * args->integ.w;
+        float row_sum = 0;
+        for (int w = 0; w < args->im.w; w++) {
+            row_sum += in[w];
+            out[w] = row_sum;
+        }
+    }
+}
+
+// Add the row above down columns [x0, x1) of channels [c0, c1).
+void integral_columns(void *ptr, int x0, int c0, int x1, int c1)
+{
+    image integ = ((integral_args *)ptr)->integ;
+    for (int c = c0; c < c1; c++) {
+        for (int h = 1; h < integ.h; h++) {
+            float *above = image_row(integ, h - 1, c);
+            float *out = image_row(integ, h, c);
+            for (int w = x0; w < x1; w++) {
+                out[w] += above[w];
             }
         }
     }
-    return integ;
 }
 
-// Apply a box filter to an image using an integral image for speed
+// Apply a box filter to an image with running sums, the same as convolving
+// with make_box_filter(s) but in constant time per pixel.
 // image im: image to smooth
 // int s: window size for box filter
 // returns: smoothed image
 image box_filter_image(image im, int s)
 {
-    image integ = make_integral_image(im);
-    image S = make_image(im.w, im.h, im.c);
-
-    int half = s / 2;
-    for (int c = 0; c < im.c; c++) {
-        for (int h = 0; h < im.h; h++) {
-            for (int w = 0; w < im.w; w++) {
-                float val = 0;
-
-                if (w - half >= 0 && h - half >= 0) {
-                    val += get_pixel(integ, w - half, h - half, c);
-                }
-
-                if (w + half < integ.w && h - half >= 0) {
-                    val -= get_pixel(integ, w + half, h - half, c);
-                }
-
-                if (w - half >= 0 && h + half < integ.h) {
-                    val -= get_pixel(integ, w - half, h + half, c);
-                }
-
-                if (w + half < integ.w && h + half < integ.h) {
-                    val += get_pixel(integ, w + half, h + half, c);
-                }
-
-                set_pixel(S, w, h, c, val / (s * s));
-            }
-        }
-    }
-
-    free_image(integ);
+    image S = make_temp_image(im.w, im.h, im.c);
+    box_sum(image_view(im), S, s, s, 1. / (s * s), BORDER_CLAMP);
     return S;
 }
 
@@ -125,58 +124,72 @@ image time_structure_matrix(image im, image prev, int s)
     }
 
     image* gradients_im = image_gradients(im);
-    image S = make_image(im.w, im.h, 5);
-
-    for (int h = 0; h < im.h; h++) {
-        for (int w = 0; w < im.w; w++) {
-            float Ix = get_pixel(gradients_im[0], w, h, 0);
-            float Iy = get_pixel(gradients_im[1], w, h, 0);
-            float It = get_pixel(prev, w, h, 0) - get_pixel(im, w, h, 0);
-
-            set_pixel(S, w, h, 0, Ix * Ix);
-            set_pixel(S, w, h, 1, Iy * Iy);
-            set_pixel(S, w, h, 2, Ix * Iy);
-            set_pixel(S, w, h, 3, Ix * It);
-            set_pixel(S, w, h, 4, Iy * It);
-        }
+    image S = make_temp_image(im.w, im.h, 5);
+
+    int size = im.w * im.h;
+    for (int i = 0; i < size; i++) {
+        float Ix = gradients_im[0].data[i];
+        float Iy = gradients_im[1].data[i];
+        float It = prev.data[i] - im.data[i];
+
+        S.data[i + 0 * size] = Ix * Ix;
+        S.data[i + 1 * size] = Iy * Iy;
+        S.data[i + 2 * size] = Ix * Iy;
+        S.data[i + 3 * size] = Ix * It;
+        S.data[i + 4 * size] = Iy * It;
     }
 
-    image smooth_image = box_filter_image(S, s);
-    free_image(S);
+    box_sum(image_view(S), S, s, s, 1. / (s * s), BORDER_CLAMP);
     free_image(gradients_im[0]);
     free_image(gradients_im[1]);
+    free(gradients_im);
 
     if (converted) {
         free_image(im); free_image(prev);
     }
-    return smooth_image;
+    return S;
 }
 
 image* image_gradients(image im) {
-    image gradient_x = make_gx_filter();
-    image gradient_y = make_gy_filter();
-
     image* gradients = calloc(2, sizeof(image));
+    gradients[0] = make_temp_image(im.w, im.h, 1);
+    gradients[1] = make_temp_image(im.w, im.h, 1);
 
-    gradients[0] = convolve_image(im, gradient_x, 0);
-    gradients[1] = convolve_image(im, gradient_y, 0);
-
-    free_image(gradient_x);
-    free_image(gradient_y);
-
+    image none = {0};
+    sobel_gradients(image_view(im), gradients[0], gradients[1], none, none);
     return gradients;
 }
 
+typedef struct{
+    image S;
+    image v;
+    int stride;
+} velocity_args;
+
 // Calculate the velocity given a structure image
 // image S: time-structure image
 // int stride: only calculate subset of pixels for speed
 image velocity_image(image S, int stride)
 {
     image v = make_image(S.w/stride, S.h/stride, 3);
+    velocity_args args = {S, v, stride};
+    int first = (stride-1)/2;
+    int rows = S.h > first ? (S.h - first + stride - 1) / stride : 0;
+    parallel_for(rows, velocity_rows, &args);
+    return v;
+}
+
+// Solve for the velocity on sample rows [start, end), every stride pixels.
+void velocity_rows(void *ptr, int start, int end)
+{
+    velocity_args *args = ptr;
+    image S = args->S;
+    image v = args->v;
+    int stride = args->stride;
     int i, j;
     matrix M = make_matrix(2, 2);
     matrix b = make_matrix(2, 1);
-    for(j = (stride-1)/2; j < S.h; j += stride){
+    for(j = (stride-1)/2 + start*stride; j < S.h && j < (stride-1)/2 + end*stride; j += stride){
         for(i = (stride-1)/2; i < S.w; i += stride){
             float Ixx = S.data[i + S.w*j + 0*S.w*S.h];
             float Iyy = S.data[i + S.w*j + 1*S.w*S.h];
@@ -210,8 +223,6 @@ image velocity_image(image S, int stride)
 
     free_matrix(M);
     free_matrix(b);
-
-    return v;
 }
 
 // Draw lines on an image given the velocity
@@ -263,38 +274,65 @@ image optical_flow_images(image im, image prev, int smooth, int stride)
     return vs;
 }
 
-// Run optical flow demo on webcam
+// Show the flow between consecutive frames of a stream, until the stream
+// runs out or ESC is pressed. Frames are taken and freed through whatever
+// image pool is active, so every buffer is released exactly once.
+// void *stream: passed to next_frame.
+// next_frame: returns the next frame, or an image without data at the end.
+// show: displays an image and returns the key pressed, or -1.
 // int smooth: amount to smooth structure matrix by
 // int stride: downsampling for velocity matrix
-// int div: downsampling factor for images from webcam
-void optical_flow_webcam(int smooth, int stride, int div)
+// int div: downsampling factor for the frames
+void optical_flow_stream(void *stream, image (*next_frame)(void *),
+                         int (*show)(image, const char *, int),
+                         int smooth, int stride, int div)
 {
-#ifdef OPENCV
-    void * cap;
-    cap = open_video_stream(0, 0, 1280, 720, 30);
-    image prev = get_image_from_stream(cap);
-    image prev_c = nn_resize(prev, prev.w/div, prev.h/div);
-    image im = get_image_from_stream(cap);
-    image im_c = nn_resize(im, im.w/div, im.h/div);
+    image prev = next_frame(stream);
+    image prev_c = area_resize(prev, prev.w/div, prev.h/div);
+    image im = next_frame(stream);
+    image im_c = area_resize(im, im.w/div, im.h/div);
     while(im.data){
         image copy = copy_image(im);
         image v = optical_flow_images(im_c, prev_c, smooth, stride);
         draw_flow(copy, v, smooth*div);
-        int key = show_image(copy, "flow", 5);
+        int key = show(copy, "flow", 5);
         free_image(v);
         free_image(copy);
-        free_image(prev);
-        free_image(prev_c);
-        prev = im;
-        prev_c = im_c;
         if(key != -1) {
             key = key % 256;
             printf("%d\n", key);
+            // Leave before the swap, so prev and im stay distinct frames.
             if (key == 27) break;
         }
-        im = get_image_from_stream(cap);
-        im_c = nn_resize(im, im.w/div, im.h/div);
+        free_image(prev);
+        free_image(prev_c);
+        prev = im;
+        prev_c = im_c;
+        im = next_frame(stream);
+        im_c = area_resize(im, im.w/div, im.h/div);
     }
+    free_image(prev);
+    free_image(prev_c);
+    free_image(im);
+    free_image(im_c);
+}
+
+// Run optical flow demo on webcam
+// int smooth: amount to smooth structure matrix by
+// int stride: downsampling for velocity matrix
+// int div: downsampling factor for images from webcam
+void optical_flow_webcam(int smooth, int stride, int div)
+{
+#ifdef OPENCV
+    void * cap;
+    cap = open_video_stream(0, 0, 1280, 720, 30);
+    // Every frame allocates the same sizes, so after the first one all
+    // image buffers come out of the pool.
+    image_pool *pool = make_image_pool();
+    use_image_pool(pool);
+    optical_flow_stream(cap, get_image_from_stream, show_image, smooth, stride, div);
+    use_image_pool(0);
+    free_image_pool(pool);
 #else
     fprintf(stderr, "Must compile with OpenCV\n");
 #endif
@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <complex.h>
+#include "image.h"
+#include "parallel.h"
+
+// Recursive Gaussian from Deriche, "Recursively implementing the Gaussian
+// and its derivatives" (1993), fourth order. A causal filter and an anti
+// causal filter run over each line and their outputs are added, so the cost
+// per pixel does not depend on sigma. The impulse response is within 0.05%
+// of the peak of a true Gaussian for sigma of 1 and up.
+//
+// Pixels past the ends of a line repeat the edge pixel, like the clamped
+// borders of convolve_image. Both filters start in the steady state for
+// that constant, which makes the borders exact rather than approximated.
+
+#define IIR_ORDER 4
+
+typedef struct{
+    image src, dst;
+    float a[IIR_ORDER + 1];     // shared feedback, a[0] = 1
+    float bp[IIR_ORDER];        // causal taps on x[n - k]
+    float bm[IIR_ORDER + 1];    // anti causal taps on x[n + k], bm[0] = 0
+    float gp, gm;               // steady state gain of each filter
+} iir_args;
+
+void iir_rows(void *, int, int);
+void iir_columns(void *, int, int, int, int);
+
+// Multiply a polynomial in z^-1 of degree n by (1 - r z^-1).
+static void poly_mul_root(double complex *p, int n, double complex r)
+{
+    for (int i = n + 1; i > 0; i--) p[i] -= r * p[i-1];
+}
+
+// Compute the filter coefficients for a given sigma.
+void iir_coefficients(float sigma, iir_args *args)
+{
+    // Deriche's fit of exp(-t^2/2) by sum alpha_k exp(-lambda_k t), t >= 0.
+    const double complex alpha[IIR_ORDER] = {
+        0.84 + 1.8675*I, 0.84 - 1.8675*I, -0.34015 - 0.1299*I, -0.34015 + 0.1299*I};
+    const double complex lambda[IIR_ORDER] = {
+        1.783 + 0.6318*I, 1.783 - 0.6318*I, 1.723 + 1.997*I, 1.723 - 1.997*I};
+
+    double complex beta[IIR_ORDER];
+    for (int k = 0; k < IIR_ORDER; k++) beta[k] = cexp(-lambda[k] / sigma);
+
+    double complex a[IIR_ORDER + 1] = {1};
+    for (int k = 0; k < IIR_ORDER; k++) poly_mul_root(a, k, beta[k]);
+
+    // The causal filter is sum alpha_k / (1 - beta_k z^-1) over a common
+    // denominator.
+    double complex b[IIR_ORDER] = {0};
+    for (int k = 0; k < IIR_ORDER; k++) {
+        double complex p[IIR_ORDER + 1] = {1};
+        int n = 0;
+        for (int j = 0; j < IIR_ORDER; j++) {
+            if (j != k) poly_mul_root(p, n++, beta[j]);
+        }
+        for (int i = 0; i < IIR_ORDER; i++) b[i] += alpha[k] * p[i];
+    }
+
+    // The anti causal filter mirrors it without the center tap.
+    double bm[IIR_ORDER + 1] = {0};
+    for (int k = 1; k < IIR_ORDER; k++) bm[k] = creal(b[k]) - creal(a[k]) * creal(b[0]);
+    bm[IIR_ORDER] = -creal(a[IIR_ORDER]) * creal(b[0]);
+
+    double asum = 0, bpsum = 0, bmsum = 0;
+    for (int k = 0; k <= IIR_ORDER; k++) asum += creal(a[k]);
+    for (int k = 0; k < IIR_ORDER; k++) bpsum += creal(b[k]);
+    for (int k = 0; k <= IIR_ORDER; k++) bmsum += bm[k];
+
+    // Scale the taps so a constant line comes out unchanged.
+    double scale = asum / (bpsum + bmsum);
+    for (int k = 0; k <= IIR_ORDER; k++) args->a[k] = creal(a[k]);
+    for (int k = 0; k < IIR_ORDER; k++) args->bp[k] = creal(b[k]) * scale;
+    for (int k = 0; k <= IIR_ORDER; k++) args->bm[k] = bm[k] * scale;
+    args->gp = bpsum * scale / asum;
+    args->gm = bmsum * scale / asum;
+}
+
+// Filter rows [start, end) of all channels stacked on top of each other.
+void iir_rows(void *ptr, int start, int end)
+{
+    iir_args *args = ptr;
+    const float *a = args->a, *bp = args->bp, *bm = args->bm;
+    int n = args->src.w;
+    for (int r = start; r < end; r++) {
+        float *x = args->src.data + r*n;
+        float *y = args->dst.data + r*n;
+
+        float x0 = x[0];
+        float p1 = args->gp*x0, p2 = p1, p3 = p1, p4 = p1;
+        float x1 = x0, x2 = x0, x3 = x0;
+        for (int i = 0; i < n; i++) {
+            float p = bp[0]*x[i] + bp[1]*x1 + bp[2]*x2 + bp[3]*x3
+                    - a[1]*p1 - a[2]*p2 - a[3]*p3 - a[4]*p4;
+            x3 = x2; x2 = x1; x1 = x[i];
+            p4 = p3; p3 = p2; p2 = p1; p1 = p;
+            y[i] = p;
+        }
+
+        float xn = x[n-1];
+        float m1 = args->gm*xn, m2 = m1, m3 = m1, m4 = m1;
+        x1 = xn; x2 = xn; x3 = xn;
+        float x4 = xn;
+        for (int i = n - 1; i >= 0; i--) {
+            float m = bm[1]*x1 + bm[2]*x2 + bm[3]*x3 + bm[4]*x4
+                    - a[1]*m1 - a[2]*m2 - a[3]*m3 - a[4]*m4;
+            x4 = x3; x3 = x2; x2 = x1; x1 = x[i];
+            m4 = m3; m3 = m2; m2 = m1; m1 = m;
+            y[i] += m;
+        }
+    }
+}
+
+// Filter columns [x0, x1) of channels [c0, c1). The recursion runs down
+// the image a whole row at a time, so the columns sit in vectors.
+void iir_columns(void *ptr, int x0, int c0, int x1, int c1)
+{
+    iir_args *args = ptr;
+    image src = args->src, dst = args->dst;
+    const float *a = args->a, *bp = args->bp, *bm = args->bm;
+    int w = x1 - x0;
+    int h = src.h;
+    float *steady = calloc(w, sizeof(float));
+    float *ring = calloc((IIR_ORDER + 1) * w, sizeof(float));
+
+    for (int c = c0; c < c1; c++) {
+        float *first = image_row(src, 0, c) + x0;
+        for (int i = 0; i < w; i++) steady[i] = args->gp * first[i];
+        for (int y = 0; y < h; y++) {
+            const float *s0 = image_row(src, y, c) + x0;
+            const float *s1 = image_row(src, clamp_index(y - 1, h), c) + x0;
+            const float *s2 = image_row(src, clamp_index(y - 2, h), c) + x0;
+            const float *s3 = image_row(src, clamp_index(y - 3, h), c) + x0;
+            const float *p1 = y > 0 ? image_row(dst, y - 1, c) + x0 : steady;
+            const float *p2 = y > 1 ? image_row(dst, y - 2, c) + x0 : steady;
+            const float *p3 = y > 2 ? image_row(dst, y - 3, c) + x0 : steady;
+            const float *p4 = y > 3 ? image_row(dst, y - 4, c) + x0 : steady;
+            float *out = image_row(dst, y, c) + x0;
+            for (int i = 0; i < w; i++) {
+                out[i] = bp[0]*s0[i] + bp[1]*s1[i] + bp[2]*s2[i] + bp[3]*s3[i]
+                       - a[1]*p1[i] - a[2]*p2[i] - a[3]*p3[i] - a[4]*p4[i];
+            }
+        }
+
+        // The anti causal outputs are only needed four rows back, so they
+        // live in a ring of rows instead of a whole image.
+        float *last = image_row(src, h - 1, c) + x0;
+        for (int k = 1; k <= IIR_ORDER; k++) {
+            for (int i = 0; i < w; i++) ring[k*w + i] = args->gm * last[i];
+        }
+        for (int y = h - 1; y >= 0; y--) {
+            int slot = (h - 1 - y) % (IIR_ORDER + 1);
+            const float *s1 = image_row(src, clamp_index(y + 1, h), c) + x0;
+            const float *s2 = image_row(src, clamp_index(y + 2, h), c) + x0;
+            const float *s3 = image_row(src, clamp_index(y + 3, h), c) + x0;
+            const float *s4 = image_row(src, clamp_index(y + 4, h), c) + x0;
+            const float *m1 = ring + ((slot + 4) % (IIR_ORDER + 1))*w;
+            const float *m2 = ring + ((slot + 3) % (IIR_ORDER + 1))*w;
+            const float *m3 = ring + ((slot + 2) % (IIR_ORDER + 1))*w;
+            const float *m4 = ring + ((slot + 1) % (IIR_ORDER + 1))*w;
+            float *m = ring + slot*w;
+            float *out = image_row(dst, y, c) + x0;
+            for (int i = 0; i < w; i++) {
+                m[i] = bm[1]*s1[i] + bm[2]*s2[i] + bm[3]*s3[i] + bm[4]*s4[i]
+                     - a[1]*m1[i] - a[2]*m2[i] - a[3]*m3[i] - a[4]*m4[i];
+                out[i] += m[i];
+            }
+        }
+    }
+    free(steady);
+    free(ring);
+}
+
+// Blur an image with a recursive Gaussian in constant time per pixel.
+// image im: image to blur.
+// float sigma: std dev. of the Gaussian, accurate from about 1 up.
+// returns: blurred image.
+image recursive_gaussian(image im, float sigma)
+{
+    image tmp = make_temp_image(im.w, im.h, im.c);
+    image out = make_temp_image(im.w, im.h, im.c);
+    iir_args args;
+    iir_coefficients(MAX(sigma, .5), &args);
+
+    args.src = im;
+    args.dst = tmp;
+    parallel_for(im.h * im.c, iir_rows, &args);
+
+    args.src = tmp;
+    args.dst = out;
+    parallel_for_2d(im.w, im.c, 256, 1, iir_columns, &args);
+
+    free_image(tmp);
+    return out;
+}
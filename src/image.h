@@ -19,6 +19,120 @@ typedef struct{
     float *data;
 } image;
 
+// Pixel storage types for typed images.
+// PIXEL_U8, PIXEL_U16: [0,1] scaled to 255 or 65535 and rounded.
+// PIXEL_F16: IEEE half precision float.
+typedef enum{PIXEL_F32, PIXEL_U8, PIXEL_U16, PIXEL_F16} PIXEL_TYPE;
+
+// A planar image stored with a smaller pixel type.
+typedef struct{
+    int w,h,c;
+    PIXEL_TYPE type;
+    void *data;
+} typed_image;
+
+// A strided window onto float pixel data. Does not own its memory.
+// int w,h,c: size of the window.
+// int xs, ys, cs: distance in floats between neighboring columns, rows
+//                 and channels. A planar image has xs = 1, ys = w, cs = w*h.
+// int pw: padded width, columns [w, pw) of each row are scratch space that
+//         kernels may read and overwrite to avoid tail loops. pw = w when
+//         there is no padding.
+// float *data: address of pixel (0,0,0) of the window.
+typedef struct{
+    int w,h,c;
+    int xs, ys, cs;
+    int pw;
+    float *data;
+} view;
+
+// Aligned views start every row on a 64 byte boundary and pad it to a
+// whole number of cache lines.
+#define VIEW_ALIGN 64
+#define VIEW_ALIGN_FLOATS (VIEW_ALIGN / (int)sizeof(float))
+
+// How to read pixels that fall outside an image.
+// BORDER_CLAMP: repeat the edge pixel (what get_pixel does).
+// BORDER_ZERO: treat outside pixels as 0.
+// BORDER_REFLECT: mirror about the edge pixel, dcb|abcd|cba.
+// BORDER_WRAP: tile the image periodically, bcd|abcd|abc.
+typedef enum{BORDER_CLAMP, BORDER_ZERO, BORDER_REFLECT, BORDER_WRAP} BORDER;
+
+// A lazily evaluated chain of pointwise operations. Ops are only recorded
+// by the pointwise_* calls and all run together in run_pointwise.
+typedef enum{PW_SHIFT, PW_SCALE, PW_CLAMP, PW_ADD} POINTWISE_OP;
+
+typedef struct{
+    POINTWISE_OP op;
+    int c;          // Channel to apply to, -1 for all channels
+    float v;        // Shift amount, scale factor or weight of other
+    image other;    // Image to add for PW_ADD
+} pointwise_op;
+
+typedef struct{
+    int n, size;
+    pointwise_op *ops;
+} pointwise;
+
+// A cache of freed image buffers, reused by later allocations of the same
+// size while the pool is active. mallocs counts allocations the pool could
+// not serve, reuses counts the ones it could.
+typedef struct{
+    int n, size;
+    float **buffers;
+    int *lengths;
+    int mallocs, reuses;
+} image_pool;
+
+// How smooth_image blurs.
+// SMOOTH_EXACT: two passes with a 6*sigma wide sampled Gaussian.
+// SMOOTH_RECURSIVE: recursive Gaussian, cost per pixel independent of sigma.
+typedef enum{SMOOTH_EXACT, SMOOTH_RECURSIVE} SMOOTH_MODE;
+
+// Filters get_filter can hand out from its cache, named after the
+// make_*_filter function that builds them.
+typedef enum{
+    FILTER_BOX, FILTER_GAUSSIAN, FILTER_GAUSSIAN_1D, FILTER_GX, FILTER_GY,
+    FILTER_HIGHPASS, FILTER_SHARPEN, FILTER_EMBOSS
+} FILTER_TYPE;
+
+// The interior loop of a direct convolution, for one output row.
+// float **rows: the filter.h source rows the taps read, contiguous.
+// float *weights: filter.w x filter.h taps.
+// float *out: output row, pixels [x0, x1) are written.
+typedef void (*span_fn)(float **rows, float *weights, float *out, int x0, int x1);
+
+// Per channel statistics gathered in one pass by get_image_stats.
+// int c: number of channels, every array below has one entry per channel.
+// int n: pixels per channel.
+// float *min, *max, *mean, *var: population statistics of each channel.
+// double *sum, *sumsq: sum of the values and of their squares.
+// int bins: histogram bins per channel, 0 when no histogram was asked for.
+// float lo, hi: range covered by the histogram, values outside it are
+//               counted in the first or last bin.
+// int *hist: bins counts per channel, channel c starts at hist + c*bins.
+typedef struct{
+    int c, n;
+    float *min, *max, *mean, *var;
+    double *sum, *sumsq;
+    int bins;
+    float lo, hi;
+    int *hist;
+} image_stats;
+
+// A Gaussian pyramid that builds its levels the first time they are used.
+// int levels: number of levels, level 0 is the image itself.
+// float scale: size ratio between neighboring levels.
+// float sigma: std dev. of the blur applied to a level before it shrinks.
+// image *gauss, *laplace, *blur: Gaussian levels, Laplacian levels and
+//                                levels blurred at their own size. Entries
+//                                not built yet have no data.
+typedef struct{
+    int levels;
+    float scale, sigma;
+    image *gauss, *laplace, *blur;
+} pyramid;
+
 // A 2d point.
 // float x, y: the coordinates of the point.
 typedef struct{
@@ -45,22 +159,107 @@ typedef struct{
     float distance;
 } match;
 
+// Fast unchecked access, for inner loops. Callers are responsible for
+// keeping x, y and c in bounds; use get_pixel or border_index at the edges.
+#define PIXEL(im, x, y, c) ((im).data[(x) + (im).w*((y) + (im).h*(c))])
+
+static inline float *image_row(image im, int y, int c)
+{
+    return im.data + im.w*(y + im.h*c);
+}
+
+static inline float *view_row(view v, int y, int c)
+{
+    return v.data + y*v.ys + c*v.cs;
+}
+
+static inline int clamp_index(int i, int n)
+{
+    return i < 0 ? 0 : (i >= n ? n - 1 : i);
+}
+
+static inline int reflect_index(int i, int n)
+{
+    if (n == 1) return 0;
+    int period = 2*(n - 1);
+    i %= period;
+    if (i < 0) i += period;
+    return i < n ? i : period - i;
+}
+
+static inline int wrap_index(int i, int n)
+{
+    i %= n;
+    return i < 0 ? i + n : i;
+}
+
+// Map a possibly out of bounds index into [0, n) for a border mode.
+// returns: the index to read, or -1 if the pixel should read as 0.
+static inline int border_index(int i, int n, BORDER mode)
+{
+    if (i >= 0 && i < n) return i;
+    switch (mode) {
+        case BORDER_ZERO: return -1;
+        case BORDER_REFLECT: return reflect_index(i, n);
+        case BORDER_WRAP: return wrap_index(i, n);
+        default: return clamp_index(i, n);
+    }
+}
+
 // Basic operations
 float get_pixel(image im, int x, int y, int c);
 void set_pixel(image im, int x, int y, int c, float v);
 image copy_image(image im);
 image rgb_to_grayscale(image im);
+image rgb_to_grayscale_scalar(image im);
 image grayscale_to_rgb(image im, float r, float g, float b);
 void rgb_to_hsv(image im);
 void hsv_to_rgb(image im);
+void rgb_to_hsv_view(view im);
+void hsv_to_rgb_view(view im);
+void rgb_to_hsv_scalar(image im);
+void hsv_to_rgb_scalar(image im);
 void shift_image(image im, int c, float v);
 void scale_image(image im, int c, float v);
 void clamp_image(image im);
 image get_channel(image im, int c);
+image_stats get_image_stats(image im, int bins, float lo, float hi);
+image_stats get_view_stats(view v, int bins, float lo, float hi);
+void free_image_stats(image_stats s);
 int same_image(image a, image b);
 image sub_image(image a, image b);
 image add_image(image a, image b);
 
+// Fused pointwise pipelines
+pointwise make_pointwise();
+void free_pointwise(pointwise p);
+void pointwise_shift(pointwise *p, int c, float v);
+void pointwise_scale(pointwise *p, int c, float v);
+void pointwise_clamp(pointwise *p);
+void pointwise_add(pointwise *p, image b, float factor);
+void run_pointwise(pointwise p, image src, image dst);
+
+// Views
+view image_view(image im);
+view crop_view(view v, int x, int y, int w, int h);
+view channel_view(view v, int c);
+float get_view_pixel(view v, int x, int y, int c);
+void set_view_pixel(view v, int x, int y, int c, float val);
+void copy_view(view src, view dst);
+image view_to_image(view v);
+view make_aligned_view(int w, int h, int c);
+view image_to_aligned_view(image im);
+void free_aligned_view(view v);
+int view_is_aligned(view v);
+
+// Interleaved (HWC) layout
+view interleaved_view(image im);
+void interleaved_to_planar(image src, image dst);
+void planar_to_interleaved(image src, image dst);
+image load_image_interleaved(char *filename);
+void save_image_interleaved(image im, const char *name);
+void save_png_interleaved(image im, const char *name);
+
 // Loading and saving
 image make_image(int w, int h, int c);
 image load_image(char *filename);
@@ -70,14 +269,49 @@ image load_image_binary(const char *fname);
 void save_png(image im, const char *name);
 void free_image(image im);
 
+// Typed images
+typed_image make_typed_image(int w, int h, int c, PIXEL_TYPE type);
+void free_typed_image(typed_image im);
+typed_image load_typed_image(char *filename, PIXEL_TYPE type);
+image typed_to_image(typed_image im);
+typed_image image_to_typed(image im, PIXEL_TYPE type);
+void load_typed_row(typed_image im, int y, int c, float *out);
+void store_typed_row(typed_image im, int y, int c, const float *in);
+typed_image nn_resize_typed(typed_image im, int w, int h);
+typed_image bilinear_resize_typed(typed_image im, int w, int h);
+typed_image convolve_typed(typed_image im, image filter, int preserve);
+typed_image rgb_to_grayscale_typed(typed_image im);
+void rgb_to_hsv_typed(typed_image im);
+void hsv_to_rgb_typed(typed_image im);
+
+// Buffer pools
+image_pool *make_image_pool();
+void free_image_pool(image_pool *p);
+void use_image_pool(image_pool *p);
+image make_temp_image(int w, int h, int c);
+
 // Resizing
 float nn_interpolate(image im, float x, float y, int c);
 image nn_resize(image im, int w, int h);
 float bilinear_interpolate(image im, float x, float y, int c);
 image bilinear_resize(image im, int w, int h);
+float nn_interpolate_view(view im, float x, float y, int c);
+float bilinear_interpolate_view(view im, float x, float y, int c);
+int find_closest_int(float f, int max);
+image nn_resize_view(view im, int w, int h);
+image bilinear_resize_view(view im, int w, int h);
+image area_resize(image im, int w, int h);
+image area_resize_view(view im, int w, int h);
 
 // Filtering
 image convolve_image(image im, image filter, int preserve);
+image convolve_view(view im, image filter, int preserve);
+image convolve_image_border(image im, image filter, int preserve, BORDER border);
+image convolve_view_border(view im, image filter, int preserve, BORDER border);
+image convolve_fft(view im, image filter, BORDER border);
+image *convolve_bank(view im, image *filters, int n, int preserve, BORDER border);
+void set_fft_threshold(int area);
+span_fn small_filter_span(image filter);
 image make_box_filter(int w);
 image make_highpass_filter();
 image make_sharpen_filter();
@@ -85,18 +319,35 @@ image make_emboss_filter();
 image make_gaussian_filter(float sigma);
 image make_gx_filter();
 image make_gy_filter();
+image get_filter(FILTER_TYPE type, float sigma, int size);
+void free_filter_cache();
 void feature_normalize(image im);
 void l1_normalize(image im);
 void threshold_image(image im, float thresh);
 image *sobel_image(image im);
+void sobel_gradients(view im, image gx, image gy, image mag, image dir);
 image colorize_sobel(image im);
 image smooth_image(image im, float sigma);
+void set_smooth_mode(SMOOTH_MODE mode);
+image recursive_gaussian(image im, float sigma);
+void box_sum(view im, image out, int fw, int fh, float scale, BORDER border);
+image box_filter_image(image im, int s);
+image median_image(view im, int size);
+
+// Pyramids
+image blur_resize(view im, int w, int h, float sigma);
+pyramid make_pyramid(image im, int levels, float scale, float sigma);
+void free_pyramid(pyramid p);
+image pyramid_level(pyramid *p, int i);
+image pyramid_blur(pyramid *p, int i);
+image pyramid_laplacian(pyramid *p, int i);
 
 // Harris and Stitching
 point make_point(float x, float y);
 point project_point(matrix H, point p);
 matrix compute_homography(match *matches, int n);
 image structure_matrix(image im, float sigma);
+image structure_matrix_view(view im, float sigma);
 image cornerness_response(image S);
 void free_descriptors(descriptor *d, int n);
 image cylindrical_project(image im, float f);
@@ -111,6 +362,9 @@ image panorama_image(image a, image b, float sigma, float thresh, int nms, float
 
 // Optical Flow
 image optical_flow_images(image im, image prev, int smooth, int stride);
+void optical_flow_stream(void *stream, image (*next_frame)(void *),
+                         int (*show)(image, const char *, int),
+                         int smooth, int stride, int div);
 void optical_flow_webcam(int smooth, int stride, int div);
 void draw_flow(image im, image v, float scale);
 
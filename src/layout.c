@@ -0,0 +1,127 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "image.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Interleaved (HWC) images use the same image struct as planar ones, only the
+// order of the floats differs: pixel (x,y,c) lives at data[c + im.c*(x + im.w*y)].
+// Functions that take an interleaved image say so in their name, everything
+// else in the library expects planar data.
+
+// Make a view of an image whose data is stored interleaved.
+// image im: interleaved image.
+// returns: view with the same pixel addressing as image_view gives planar data.
+view interleaved_view(image im)
+{
+    view v;
+    v.w = im.w;
+    v.h = im.h;
+    v.c = im.c;
+    v.xs = im.c;
+    v.ys = im.w*im.c;
+    v.cs = 1;
+    v.pw = im.w;
+    v.data = im.data;
+    return v;
+}
+
+// Split one row of interleaved pixels into separate channel rows.
+// const float *src: w*c interleaved floats.
+// float **dst: c pointers to rows of w floats.
+void deinterleave_row(const float *src, float **dst, int w, int c)
+{
+    int i = 0;
+#ifdef __SSE2__
+    if (c == 3) {
+        float *r = dst[0], *g = dst[1], *b = dst[2];
+        for (; i + 4 <= w; i += 4) {
+            __m128 a0 = _mm_loadu_ps(src + 3*i);
+            __m128 a1 = _mm_loadu_ps(src + 3*i + 4);
+            __m128 a2 = _mm_loadu_ps(src + 3*i + 8);
+
+            __m128 q = _mm_shuffle_ps(a0, a0, _MM_SHUFFLE(0,0,3,0));
+            __m128 t = _mm_shuffle_ps(a1, a2, _MM_SHUFFLE(0,1,0,2));
+            _mm_storeu_ps(r + i, _mm_shuffle_ps(q, t, _MM_SHUFFLE(2,0,1,0)));
+
+            q = _mm_shuffle_ps(a0, a1, _MM_SHUFFLE(0,0,0,1));
+            t = _mm_shuffle_ps(a1, a2, _MM_SHUFFLE(0,2,0,3));
+            _mm_storeu_ps(g + i, _mm_shuffle_ps(q, t, _MM_SHUFFLE(2,0,2,0)));
+
+            q = _mm_shuffle_ps(a0, a1, _MM_SHUFFLE(0,1,0,2));
+            t = _mm_shuffle_ps(a2, a2, _MM_SHUFFLE(0,3,0,0));
+            _mm_storeu_ps(b + i, _mm_shuffle_ps(q, t, _MM_SHUFFLE(2,0,2,0)));
+        }
+    }
+#endif
+    for (; i < w; i++) {
+        for (int k = 0; k < c; k++) {
+            dst[k][i] = src[i*c + k];
+        }
+    }
+}
+
+// Merge separate channel rows into one row of interleaved pixels.
+// const float **src: c pointers to rows of w floats.
+// float *dst: w*c interleaved floats.
+void interleave_row(const float **src, float *dst, int w, int c)
+{
+    int i = 0;
+#ifdef __SSE2__
+    if (c == 3) {
+        const float *r = src[0], *g = src[1], *b = src[2];
+        for (; i + 4 <= w; i += 4) {
+            __m128 R = _mm_loadu_ps(r + i);
+            __m128 G = _mm_loadu_ps(g + i);
+            __m128 B = _mm_loadu_ps(b + i);
+            __m128 lo = _mm_unpacklo_ps(R, G);
+            __m128 hi = _mm_unpackhi_ps(R, G);
+
+            __m128 t = _mm_shuffle_ps(B, lo, _MM_SHUFFLE(0,2,0,0));
+            _mm_storeu_ps(dst + 3*i, _mm_shuffle_ps(lo, t, _MM_SHUFFLE(2,0,1,0)));
+
+            t = _mm_shuffle_ps(lo, B, _MM_SHUFFLE(0,1,0,3));
+            _mm_storeu_ps(dst + 3*i + 4, _mm_shuffle_ps(t, hi, _MM_SHUFFLE(1,0,2,0)));
+
+            __m128 q = _mm_shuffle_ps(B, hi, _MM_SHUFFLE(0,2,0,2));
+            t = _mm_shuffle_ps(hi, B, _MM_SHUFFLE(0,3,0,3));
+            _mm_storeu_ps(dst + 3*i + 8, _mm_shuffle_ps(q, t, _MM_SHUFFLE(2,0,2,0)));
+        }
+    }
+#endif
+    for (; i < w; i++) {
+        for (int k = 0; k < c; k++) {
+            dst[i*c + k] = src[k][i];
+        }
+    }
+}
+
+// Convert an interleaved image to planar layout.
+// image src: interleaved image.
+// image dst: planar image of the same size, filled in.
+void interleaved_to_planar(image src, image dst)
+{
+    assert(src.w == dst.w && src.h == dst.h && src.c == dst.c);
+    float **rows = calloc(src.c, sizeof(float *));
+    for (int y = 0; y < src.h; y++) {
+        for (int k = 0; k < src.c; k++) rows[k] = dst.data + y*dst.w + k*dst.w*dst.h;
+        deinterleave_row(src.data + y*src.w*src.c, rows, src.w, src.c);
+    }
+    free(rows);
+}
+
+// Convert a planar image to interleaved layout.
+// image src: planar image.
+// image dst: interleaved image of the same size, filled in.
+void planar_to_interleaved(image src, image dst)
+{
+    assert(src.w == dst.w && src.h == dst.h && src.c == dst.c);
+    const float **rows = calloc(src.c, sizeof(float *));
+    for (int y = 0; y < src.h; y++) {
+        for (int k = 0; k < src.c; k++) rows[k] = src.data + y*src.w + k*src.w*src.h;
+        interleave_row(rows, dst.data + y*dst.w*dst.c, dst.w, dst.c);
+    }
+    free(rows);
+}
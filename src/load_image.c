@@ -14,10 +14,13 @@ image make_empty_image(int w, int h, int c)
     return out;
 }
 
+float *pool_alloc(int n, int zero);
+void pool_release(float *data, int n);
+
 image make_image(int w, int h, int c)
 {
     image out = make_empty_image(w,h,c);
-    out.data = calloc(h*w*c, sizeof(float));
+    out.data = pool_alloc(h*w*c, 1);
     return out;
 }
 
@@ -26,28 +29,65 @@ image make_image(int w, int h, int c)
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
-void save_image_stb(image im, const char *name, int png)
+void deinterleave_row(const float *src, float **dst, int w, int c);
+void interleave_row(const float **src, float *dst, int w, int c);
+
+void write_image_stb(unsigned char *data, int w, int h, int c, const char *name, int png)
 {
     char buff[256];
-    unsigned char *data = calloc(im.w*im.h*im.c, sizeof(char));
-    int i,k;
-    for(k = 0; k < im.c; ++k){
-        for(i = 0; i < im.w*im.h; ++i){
-            data[i*im.c+k] = (unsigned char) roundf((255*im.data[i + k*im.w*im.h]));
-        }
-    }
     int success = 0;
     if(png){
         sprintf(buff, "%s.png", name);
-        success = stbi_write_png(buff, im.w, im.h, im.c, data, im.w*im.c);
+        success = stbi_write_png(buff, w, h, c, data, w*c);
     } else {
         sprintf(buff, "%s.jpg", name);
-        success = stbi_write_jpg(buff, im.w, im.h, im.c, data, 100);
+        success = stbi_write_jpg(buff, w, h, c, data, 100);
     }
-    free(data);
     if(!success) fprintf(stderr, "Failed to write image %s\n", buff);
 }
 
+void save_image_stb(image im, const char *name, int png)
+{
+    unsigned char *data = calloc(im.w*im.h*im.c, sizeof(char));
+    float *row = calloc(im.w*im.c, sizeof(float));
+    const float **planes = calloc(im.c, sizeof(float *));
+    int i,j,k;
+    for(j = 0; j < im.h; ++j){
+        for(k = 0; k < im.c; ++k) planes[k] = im.data + j*im.w + k*im.w*im.h;
+        interleave_row(planes, row, im.w, im.c);
+        unsigned char *out = data + j*im.w*im.c;
+        for(i = 0; i < im.w*im.c; ++i){
+            out[i] = (unsigned char) roundf(255*row[i]);
+        }
+    }
+    write_image_stb(data, im.w, im.h, im.c, name, png);
+    free(planes);
+    free(row);
+    free(data);
+}
+
+// Save an image whose data is stored interleaved (HWC), no transpose needed.
+void save_image_interleaved_stb(image im, const char *name, int png)
+{
+    int i;
+    unsigned char *data = calloc(im.w*im.h*im.c, sizeof(char));
+    for(i = 0; i < im.w*im.h*im.c; ++i){
+        data[i] = (unsigned char) roundf(255*im.data[i]);
+    }
+    write_image_stb(data, im.w, im.h, im.c, name, png);
+    free(data);
+}
+
+void save_png_interleaved(image im, const char *name)
+{
+    save_image_interleaved_stb(im, name, 1);
+}
+
+void save_image_interleaved(image im, const char *name)
+{
+    save_image_interleaved_stb(im, name, 0);
+}
+
 void save_png(image im, const char *name)
 {
     save_image_stb(im, name, 1);
@@ -75,17 +115,51 @@ image load_image_stb(char *filename, int channels)
     if (channels) c = channels;
     int i,j,k;
     image im = make_image(w, h, c);
-    for(k = 0; k < c; ++k){
-        for(j = 0; j < h; ++j){
-            for(i = 0; i < w; ++i){
-                int dst_index = i + w*j + w*h*k;
-                int src_index = k + c*i + c*w*j;
-                im.data[dst_index] = (float)data[src_index]/255.;
-            }
+    float *row = calloc(w*c, sizeof(float));
+    float **planes = calloc(c, sizeof(float *));
+    for(j = 0; j < h; ++j){
+        unsigned char *src = data + j*w*c;
+        for(i = 0; i < w*c; ++i){
+            row[i] = (float)src[i]/255.;
         }
+        for(k = 0; k < c; ++k) planes[k] = im.data + j*w + k*w*h;
+        deinterleave_row(row, planes, w, c);
     }
     //We don't like alpha channels, #YOLO
     if(im.c == 4) im.c = 3;
+    free(planes);
+    free(row);
+    free(data);
+    return im;
+}
+
+//
+// Load an image using stb, keeping stb's interleaved (HWC) pixel order.
+// Alpha channels are dropped like in load_image_stb.
+//
+image load_image_interleaved(char *filename)
+{
+    int w, h, c;
+    unsigned char *data = stbi_load(filename, &w, &h, &c, 0);
+    if (!data) {
+        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n",
+            filename, stbi_failure_reason());
+        exit(0);
+    }
+    int i,k;
+    int oc = (c == 4) ? 3 : c;
+    image im = make_image(w, h, oc);
+    if(oc == c){
+        for(i = 0; i < w*h*c; ++i){
+            im.data[i] = (float)data[i]/255.;
+        }
+    } else {
+        for(i = 0; i < w*h; ++i){
+            for(k = 0; k < oc; ++k){
+                im.data[i*oc + k] = (float)data[i*c + k]/255.;
+            }
+        }
+    }
     free(data);
     return im;
 }
@@ -122,6 +196,6 @@ image load_image_binary(const char *fname)
 
 void free_image(image im)
 {
-    free(im.data);
+    pool_release(im.data, im.w*im.h*im.c);
 }
 
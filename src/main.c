@@ -3,11 +3,13 @@
 #include "image.h"
 #include "test.h"
 #include "args.h"
+#include "bench.h"
 
 int main(int argc, char **argv)
 {
     if(argc < 3){
         printf("usage: %s test <hw0 | hw1...>\n", argv[0]);  
+        printf("       %s bench <convolve | smooth | bank>\n", argv[0]);
     } else if (0 == strcmp(argv[1], "test")){
         if (0 == strcmp(argv[2], "hw0")) test_hw0();
         if (0 == strcmp(argv[2], "hw1")) test_hw1();
@@ -15,6 +17,8 @@ int main(int argc, char **argv)
         if (0 == strcmp(argv[2], "hw3")) test_hw3();
         if (0 == strcmp(argv[2], "hw4")) test_hw4();
         if (0 == strcmp(argv[2], "hw5")) test_hw5();
+    } else if (0 == strcmp(argv[1], "bench")){
+        run_bench(argv[2]);
     }
     return 0;
 }
@@ -0,0 +1,314 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "image.h"
+#include "parallel.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Median filtering over square windows, with clamped borders.
+//
+// 3x3 and 5x5 windows gather their pixels and run a sorting network cut
+// down to the comparisons the middle value depends on. Blocks of
+// MEDIAN_BLOCK pixels go through it together, so every compare and exchange
+// is a vector min and max.
+//
+// Larger windows follow Perreault and Hebert, "Median Filtering in Constant
+// Time" (2007). Every column keeps a histogram of its pixels inside the
+// window, and the window histogram slides along a row by adding the column
+// that enters and subtracting the one that leaves. A 16 bin coarse level
+// finds which group of 16 fine bins holds the median, and only that group
+// of the fine histogram is brought up to date. The cost per pixel does not
+// depend on the window size. Histograms have 256 bins, so these windows
+// work on values quantized to steps of 1/255, which loses nothing on 8 bit
+// images.
+
+#define MEDIAN_BLOCK 64
+#define MEDIAN_BINS 256
+#define MEDIAN_COARSE 16
+#define MEDIAN_STRIP 128
+
+typedef struct{
+    int lo, hi;     // slots compared, the smaller value ends up in lo
+    int keep;       // 1 when only the min is used later, 2 only the max, 3 both
+} comparator;
+
+typedef struct{
+    view im;
+    image out;
+    int r;
+    int *cols;          // clamped source column of padded column i, the
+                        // window of output x covers padded [x, x + 2r]
+    comparator *net;
+    int ncmp;
+    int mid;            // slot that ends up holding the median
+} median_args;
+
+void median_network_rows(void *, int, int);
+void median_histogram_tile(void *, int, int, int, int);
+
+// Build a network that moves the median of n values into one slot.
+// Batcher's odd-even merge sort runs over the next power of two of wires,
+// the missing wires hold +inf and are resolved here rather than compared.
+// Comparisons whose results the median never reads are then dropped.
+// int *mid: set to the slot holding the median.
+// returns: the comparators, *ncmp of them.
+comparator *make_median_network(int n, int *ncmp, int *mid)
+{
+    int wires = 1;
+    while (wires < n) wires <<= 1;
+    int *slot = calloc(wires, sizeof(int));
+    int *inf = calloc(wires, sizeof(int));
+    for (int i = 0; i < wires; i++) {
+        slot[i] = i;
+        inf[i] = i >= n;
+    }
+
+    int size = 16, count = 0;
+    comparator *net = calloc(size, sizeof(comparator));
+    for (int p = 1; p < wires; p <<= 1) {
+        for (int k = p; k >= 1; k >>= 1) {
+            for (int j = k % p; j + k < wires; j += 2*k) {
+                for (int i = 0; i < k && i + j + k < wires; i++) {
+                    int a = i + j, b = i + j + k;
+                    if ((i + j) / (2*p) != (i + j + k) / (2*p)) continue;
+                    if (inf[b]) continue;
+                    if (inf[a]) {
+                        // The value moves down and +inf moves up, no compare.
+                        slot[a] = slot[b];
+                        inf[a] = 0;
+                        inf[b] = 1;
+                        continue;
+                    }
+                    if (count == size) {
+                        size *= 2;
+                        net = realloc(net, size * sizeof(comparator));
+                    }
+                    comparator c = {slot[a], slot[b], 3};
+                    net[count++] = c;
+                }
+            }
+        }
+    }
+    *mid = slot[n/2];
+
+    // Walk back from the median, keeping what it depends on.
+    int *needed = calloc(n, sizeof(int));
+    needed[*mid] = 1;
+    int kept = count;
+    for (int i = count - 1; i >= 0; i--) {
+        comparator *c = net + i;
+        c->keep = (needed[c->lo] ? 1 : 0) | (needed[c->hi] ? 2 : 0);
+        if (c->keep) needed[c->lo] = needed[c->hi] = 1;
+        else kept--;
+    }
+    int m = 0;
+    for (int i = 0; i < count; i++) {
+        if (net[i].keep) net[m++] = net[i];
+    }
+    assert(m == kept);
+    *ncmp = m;
+
+    free(slot);
+    free(inf);
+    free(needed);
+    return net;
+}
+
+// Median filter rows [start, end) of all channels stacked, gathering every
+// window into slots of MEDIAN_BLOCK pixels and running the network on them.
+void median_network_rows(void *ptr, int start, int end)
+{
+    median_args *args = ptr;
+    view im = args->im;
+    int r = args->r;
+    int k = 2*r + 1;
+    float *v = calloc(k * k * MEDIAN_BLOCK, sizeof(float));
+    float **rows = calloc(k, sizeof(float *));
+
+    for (int row = start; row < end; row++) {
+        int c = row / im.h;
+        int y = row % im.h;
+        for (int dy = 0; dy < k; dy++) rows[dy] = view_row(im, clamp_index(y - r + dy, im.h), c);
+        float *out = image_row(args->out, y, c);
+
+        for (int x0 = 0; x0 < im.w; x0 += MEDIAN_BLOCK) {
+            int n = MIN(MEDIAN_BLOCK, im.w - x0);
+            int inside = im.xs == 1 && x0 >= r && x0 + n + r <= im.w;
+            for (int dy = 0; dy < k; dy++) {
+                for (int dx = 0; dx < k; dx++) {
+                    float *s = v + (dy*k + dx) * MEDIAN_BLOCK;
+                    if (inside) {
+                        memcpy(s, rows[dy] + x0 + dx - r, n * sizeof(float));
+                    } else {
+                        const int *cols = args->cols + x0 + dx;
+                        for (int i = 0; i < n; i++) s[i] = rows[dy][cols[i] * im.xs];
+                    }
+                }
+            }
+            for (int j = 0; j < args->ncmp; j++) {
+                comparator cmp = args->net[j];
+                float *a = v + cmp.lo * MEDIAN_BLOCK;
+                float *b = v + cmp.hi * MEDIAN_BLOCK;
+                if (cmp.keep == 3) {
+                    for (int i = 0; i < MEDIAN_BLOCK; i++) {
+                        float lo = a[i] < b[i] ? a[i] : b[i];
+                        float hi = a[i] < b[i] ? b[i] : a[i];
+                        a[i] = lo;
+                        b[i] = hi;
+                    }
+                } else if (cmp.keep == 1) {
+                    for (int i = 0; i < MEDIAN_BLOCK; i++) a[i] = a[i] < b[i] ? a[i] : b[i];
+                } else {
+                    for (int i = 0; i < MEDIAN_BLOCK; i++) b[i] = a[i] < b[i] ? b[i] : a[i];
+                }
+            }
+            memcpy(out + x0, v + args->mid * MEDIAN_BLOCK, n * sizeof(float));
+        }
+    }
+    free(v);
+    free(rows);
+}
+
+static inline int median_bin(float v)
+{
+    if (v <= 0) return 0;
+    if (v >= 1) return MEDIAN_BINS - 1;
+    return v * (MEDIAN_BINS - 1) + .5f;
+}
+
+// dst[i] += in[i] - out[i] over 16 bins, out may be 0.
+static inline void slide_bins(unsigned short *dst, const unsigned short *in, const unsigned short *out)
+{
+#ifdef __SSE2__
+    for (int i = 0; i < 16; i += 8) {
+        __m128i d = _mm_add_epi16(_mm_loadu_si128((__m128i *)(dst + i)), _mm_loadu_si128((__m128i *)(in + i)));
+        if (out) d = _mm_sub_epi16(d, _mm_loadu_si128((__m128i *)(out + i)));
+        _mm_storeu_si128((__m128i *)(dst + i), d);
+    }
+#else
+    for (int i = 0; i < 16; i++) dst[i] += in[i] - (out ? out[i] : 0);
+#endif
+}
+
+// Add sign times the bins of source columns [x0, x1) of one row to the
+// column histograms, which start at column x0.
+void add_histogram_row(unsigned short *fine, unsigned short *coarse, float *row, int xs, int x0, int x1, int sign)
+{
+    for (int x = x0; x < x1; x++) {
+        int b = median_bin(row[x * xs]);
+        fine[(x - x0)*MEDIAN_BINS + b] += sign;
+        coarse[(x - x0)*MEDIAN_COARSE + b / (MEDIAN_BINS / MEDIAN_COARSE)] += sign;
+    }
+}
+
+// Median filter the tile [x0, x1) x [y0, y1) of all channels stacked with
+// sliding histograms. Tiles are narrow so the column histograms they need
+// stay in cache. Those are built once per tile and then move down one row
+// at a time.
+void median_histogram_tile(void *ptr, int x0, int y0, int x1, int y1)
+{
+    median_args *args = ptr;
+    view im = args->im;
+    int r = args->r;
+    int k = 2*r + 1;
+    int target = k*k / 2;
+    const int g = MEDIAN_BINS / MEDIAN_COARSE;
+
+    // Output x reads padded columns [x, x + 2r], which cover the source
+    // columns [lo, hi). Histogram i belongs to source column lo + i.
+    int lo = args->cols[x0], hi = args->cols[x1 - 1 + 2*r] + 1;
+    int *cols = calloc(x1 - x0 + 2*r, sizeof(int));
+    for (int i = 0; i < x1 - x0 + 2*r; i++) cols[i] = args->cols[x0 + i] - lo;
+    unsigned short *fine = calloc((hi - lo) * MEDIAN_BINS, sizeof(unsigned short));
+    unsigned short *coarse = calloc((hi - lo) * MEDIAN_COARSE, sizeof(unsigned short));
+    unsigned short kfine[MEDIAN_BINS], kcoarse[MEDIAN_COARSE];
+    int valid[MEDIAN_COARSE];   // x the fine group was last brought to
+
+    for (int row = y0; row < y1; row++) {
+        int c = row / im.h;
+        int y = row % im.h;
+        if (row == y0 || y == 0) {
+            memset(fine, 0, (hi - lo) * MEDIAN_BINS * sizeof(unsigned short));
+            memset(coarse, 0, (hi - lo) * MEDIAN_COARSE * sizeof(unsigned short));
+            for (int dy = -r; dy <= r; dy++) {
+                float *src = view_row(im, clamp_index(y + dy, im.h), c);
+                add_histogram_row(fine, coarse, src, im.xs, lo, hi, 1);
+            }
+        } else {
+            add_histogram_row(fine, coarse, view_row(im, clamp_index(y - r - 1, im.h), c), im.xs, lo, hi, -1);
+            add_histogram_row(fine, coarse, view_row(im, clamp_index(y + r, im.h), c), im.xs, lo, hi, 1);
+        }
+
+        memset(kcoarse, 0, sizeof(kcoarse));
+        for (int i = 0; i < k; i++) {
+            slide_bins(kcoarse, coarse + cols[i] * MEDIAN_COARSE, 0);
+        }
+        for (int b = 0; b < MEDIAN_COARSE; b++) valid[b] = -k - 1;
+
+        float *out = image_row(args->out, y, c) + x0;
+        for (int x = 0; x < x1 - x0; x++) {
+            if (x > 0) {
+                slide_bins(kcoarse, coarse + cols[x + 2*r] * MEDIAN_COARSE, coarse + cols[x - 1] * MEDIAN_COARSE);
+            }
+
+            int b = 0, count = 0;
+            while (count + kcoarse[b] <= target) count += kcoarse[b++];
+
+            unsigned short *kf = kfine + b*g;
+            // Rebuild the group when that is cheaper than replaying every
+            // column that moved since it was last used.
+            if (2*(x - valid[b]) > k) {
+                memset(kf, 0, g * sizeof(unsigned short));
+                for (int i = 0; i < k; i++) slide_bins(kf, fine + cols[x + i] * MEDIAN_BINS + b*g, 0);
+            } else {
+                for (int p = valid[b] + 1; p <= x; p++) {
+                    slide_bins(kf, fine + cols[p + 2*r] * MEDIAN_BINS + b*g, fine + cols[p - 1] * MEDIAN_BINS + b*g);
+                }
+            }
+            valid[b] = x;
+
+            int j = 0;
+            while (count + kf[j] <= target) count += kf[j++];
+            out[x] = (b*g + j) / (float)(MEDIAN_BINS - 1);
+        }
+    }
+    free(cols);
+    free(fine);
+    free(coarse);
+}
+
+// Replace every pixel by the median of the size x size window around it,
+// in each channel. Good at removing salt and pepper noise while keeping
+// edges sharp. Pixels past the edges repeat the edge pixel.
+// view im: image to filter.
+// int size: odd window size, at most 255. Sizes up to 5 give exact medians,
+//           larger ones medians of the values rounded to steps of 1/255 and
+//           clamped to [0, 1].
+// returns: filtered image.
+image median_image(view im, int size)
+{
+    assert(size % 2 == 1 && size < 256);
+    int r = size / 2;
+    median_args args = {0};
+    args.im = im;
+    args.out = make_temp_image(im.w, im.h, im.c);
+    args.r = r;
+
+    int padded = im.w + 2*r;
+    args.cols = calloc(padded, sizeof(int));
+    for (int i = 0; i < padded; i++) args.cols[i] = clamp_index(i - r, im.w);
+
+    if (size <= 5) {
+        args.net = make_median_network(size * size, &args.ncmp, &args.mid);
+        parallel_for(im.h * im.c, median_network_rows, &args);
+        free(args.net);
+    } else {
+        // Bands have to be a few windows tall to make up for building the
+        // histograms at their top.
+        parallel_for_2d(im.w, im.h * im.c, MEDIAN_STRIP, MAX(4*size, 64), median_histogram_tile, &args);
+    }
+    free(args.cols);
+    return args.out;
+}
@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "parallel.h"
+
+// A persistent pool of worker threads. The calling thread always takes part
+// in its own loops, and workers are only started the first time a loop asks
+// for more threads than are running. Loops started from inside a parallel
+// loop run serially on the thread that started them.
+
+typedef struct job{
+    void (*run)(struct job *j, int chunk);
+    range_fn fn;
+    tile_fn tfn;
+    void *ctx;
+    int n, chunks;
+    int w, h, tw, th, tiles_x;
+    int max_workers;
+    int joined, running;
+    int next, done;
+} job;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;
+static job *current_job = 0;
+static int generation = 0;
+static int nworkers = 0;
+static int num_threads = 0;
+static __thread int inside_parallel = 0;
+
+// Set the number of threads loops use by default.
+// int n: thread count, 0 or less means one per online core.
+void set_num_threads(int n)
+{
+    num_threads = n;
+}
+
+int get_num_threads()
+{
+    if (num_threads <= 0) {
+        char *env = getenv("UWIMG_THREADS");
+        int n = env ? atoi(env) : 0;
+        if (n <= 0) n = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = n > 0 ? n : 1;
+    }
+    return num_threads;
+}
+
+static void run_chunks(job *j)
+{
+    int chunk;
+    while ((chunk = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) < j->chunks) {
+        j->run(j, chunk);
+        __atomic_fetch_add(&j->done, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void *worker(void *arg)
+{
+    int seen = 0;
+    inside_parallel = 1;
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        while (seen == generation) pthread_cond_wait(&work_ready, &pool_lock);
+        seen = generation;
+        job *j = current_job;
+        if (!j || j->joined >= j->max_workers) continue;
+        j->joined++;
+        j->running++;
+        pthread_mutex_unlock(&pool_lock);
+
+        run_chunks(j);
+
+        pthread_mutex_lock(&pool_lock);
+        j->running--;
+        if (j->running == 0) pthread_cond_broadcast(&work_done);
+    }
+    return 0;
+}
+
+static void start_workers(int n)
+{
+    while (nworkers < n) {
+        pthread_t t;
+        if (pthread_create(&t, 0, worker, 0)) break;
+        pthread_detach(t);
+        nworkers++;
+    }
+}
+
+static void run_job(job *j, int threads)
+{
+    if (threads > j->chunks) threads = j->chunks;
+    if (threads <= 1 || inside_parallel) {
+        for (int i = 0; i < j->chunks; i++) j->run(j, i);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    start_workers(threads - 1);
+    j->max_workers = threads - 1;
+    current_job = j;
+    generation++;
+    pthread_cond_broadcast(&work_ready);
+    pthread_mutex_unlock(&pool_lock);
+
+    inside_parallel = 1;
+    run_chunks(j);
+    inside_parallel = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    while (j->running > 0 || __atomic_load_n(&j->done, __ATOMIC_ACQUIRE) < j->chunks) {
+        pthread_cond_wait(&work_done, &pool_lock);
+    }
+    current_job = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void run_range(job *j, int chunk)
+{
+    int start = (long long)j->n * chunk / j->chunks;
+    int end = (long long)j->n * (chunk + 1) / j->chunks;
+    if (start < end) j->fn(j->ctx, start, end);
+}
+
+static void run_tile(job *j, int chunk)
+{
+    int x0 = (chunk % j->tiles_x) * j->tw;
+    int y0 = (chunk / j->tiles_x) * j->th;
+    int x1 = x0 + j->tw < j->w ? x0 + j->tw : j->w;
+    int y1 = y0 + j->th < j->h ? y0 + j->th : j->h;
+    j->tfn(j->ctx, x0, y0, x1, y1);
+}
+
+// Run fn over [0, n) split into bands, with an explicit thread count.
+// int threads: threads to use, 0 or less for the global default.
+void parallel_for_threads(int n, range_fn fn, void *ctx, int threads)
+{
+    if (n <= 0) return;
+    if (threads <= 0) threads = get_num_threads();
+    job j = {0};
+    j.run = run_range;
+    j.fn = fn;
+    j.ctx = ctx;
+    j.n = n;
+    // A few bands per thread so uneven rows still balance out.
+    j.chunks = threads > 1 ? (n < 4*threads ? n : 4*threads) : 1;
+    run_job(&j, threads);
+}
+
+// Run fn over [0, n) split into bands across the default thread count.
+void parallel_for(int n, range_fn fn, void *ctx)
+{
+    parallel_for_threads(n, fn, ctx, 0);
+}
+
+// Run fn over a w x h grid cut into tw x th tiles.
+void parallel_for_2d(int w, int h, int tw, int th, tile_fn fn, void *ctx)
+{
+    if (w <= 0 || h <= 0) return;
+    if (tw <= 0) tw = w;
+    if (th <= 0) th = h;
+    job j = {0};
+    j.run = run_tile;
+    j.tfn = fn;
+    j.ctx = ctx;
+    j.w = w;
+    j.h = h;
+    j.tw = tw;
+    j.th = th;
+    j.tiles_x = (w + tw - 1) / tw;
+    j.chunks = j.tiles_x * ((h + th - 1) / th);
+    run_job(&j, get_num_threads());
+}
@@ -0,0 +1,23 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Work on the half open range [start, end) of a 1d loop, usually rows.
+typedef void (*range_fn)(void *ctx, int start, int end);
+
+// Work on the tile [x0, x1) x [y0, y1) of a 2d loop.
+typedef void (*tile_fn)(void *ctx, int x0, int y0, int x1, int y1);
+
+void set_num_threads(int n);
+int get_num_threads();
+void parallel_for(int n, range_fn fn, void *ctx);
+void parallel_for_threads(int n, range_fn fn, void *ctx, int threads);
+void parallel_for_2d(int w, int h, int tw, int th, tile_fn fn, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "image.h"
+#include "parallel.h"
+
+// Pixels are pushed through the recorded ops a block at a time, so every
+// op after the first works on data that is still in L1.
+#define POINTWISE_BLOCK 1024
+
+pointwise make_pointwise()
+{
+    pointwise p;
+    p.n = 0;
+    p.size = 4;
+    p.ops = calloc(p.size, sizeof(pointwise_op));
+    return p;
+}
+
+void free_pointwise(pointwise p)
+{
+    free(p.ops);
+}
+
+static void push_op(pointwise *p, pointwise_op op)
+{
+    if (p->n == p->size) {
+        p->size *= 2;
+        p->ops = realloc(p->ops, p->size * sizeof(pointwise_op));
+    }
+    p->ops[p->n++] = op;
+}
+
+// Record im[c] += v. c < 0 applies it to every channel.
+void pointwise_shift(pointwise *p, int c, float v)
+{
+    pointwise_op op = {PW_SHIFT, c, v, {0}};
+    push_op(p, op);
+}
+
+// Record im[c] *= v. c < 0 applies it to every channel.
+void pointwise_scale(pointwise *p, int c, float v)
+{
+    pointwise_op op = {PW_SCALE, c, v, {0}};
+    push_op(p, op);
+}
+
+// Record clamping every channel to [0, 1].
+void pointwise_clamp(pointwise *p)
+{
+    pointwise_op op = {PW_CLAMP, -1, 0, {0}};
+    push_op(p, op);
+}
+
+// Record im += factor * b. b must match the size of the image the pipeline
+// runs on, and must stay alive until run_pointwise.
+void pointwise_add(pointwise *p, image b, float factor)
+{
+    pointwise_op op = {PW_ADD, -1, factor, b};
+    push_op(p, op);
+}
+
+static void apply_op(pointwise_op op, float *x, int n, int offset)
+{
+    int i;
+    switch (op.op) {
+        case PW_SHIFT:
+            for (i = 0; i < n; i++) x[i] += op.v;
+            break;
+        case PW_SCALE:
+            for (i = 0; i < n; i++) x[i] *= op.v;
+            break;
+        case PW_CLAMP:
+            for (i = 0; i < n; i++) x[i] = x[i] < 0 ? 0 : (x[i] > 1 ? 1 : x[i]);
+            break;
+        case PW_ADD: {
+            float *b = op.other.data + offset;
+            for (i = 0; i < n; i++) x[i] += op.v * b[i];
+            break;
+        }
+    }
+}
+
+typedef struct{
+    pointwise p;
+    image src, dst;
+    int blocks;
+} pointwise_args;
+
+// Run the ops over blocks [start, end), block b is in channel b / blocks.
+static void pointwise_blocks(void *ptr, int start, int end)
+{
+    pointwise_args *args = ptr;
+    pointwise p = args->p;
+    int plane = args->src.w * args->src.h;
+    for (int b = start; b < end; b++) {
+        int c = b / args->blocks;
+        int first = (b % args->blocks) * POINTWISE_BLOCK;
+        int n = MIN(POINTWISE_BLOCK, plane - first);
+        int offset = c * plane + first;
+        float *x = args->dst.data + offset;
+        if (args->dst.data != args->src.data) memcpy(x, args->src.data + offset, n * sizeof(float));
+        for (int i = 0; i < p.n; i++) {
+            if (p.ops[i].c < 0 || p.ops[i].c == c) apply_op(p.ops[i], x, n, offset);
+        }
+    }
+}
+
+// Run all recorded ops in one pass over memory.
+// pointwise p: ops to run, in the order they were recorded.
+// image src: input image.
+// image dst: output image of the same size, may be src to work in place.
+void run_pointwise(pointwise p, image src, image dst)
+{
+    assert(src.w == dst.w && src.h == dst.h && src.c == dst.c);
+    for (int i = 0; i < p.n; i++) {
+        if (p.ops[i].op == PW_ADD) {
+            image b = p.ops[i].other;
+            assert(b.w == src.w && b.h == src.h && b.c == src.c);
+        }
+    }
+
+    pointwise_args args = {p, src, dst, (src.w * src.h + POINTWISE_BLOCK - 1) / POINTWISE_BLOCK};
+    parallel_for(src.c * args.blocks, pointwise_blocks, &args);
+}
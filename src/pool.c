@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+
+// While a pool is in use, make_image and make_temp_image take buffers from
+// it and free_image hands them back, so a loop that allocates the same
+// sizes every frame stops going to malloc after its first iteration.
+// Buffers are plain heap blocks, so an image may be freed with or without
+// a pool active no matter where it came from. Pools are not thread safe;
+// allocate and free from the thread that called use_image_pool.
+static image_pool *current_pool = 0;
+// Set on a thread whose allocations must never touch the pool, which is
+// also how other threads get to allocate safely while a pool is in use.
+static __thread int pool_bypassed = 0;
+
+image_pool *make_image_pool()
+{
+    image_pool *p = calloc(1, sizeof(image_pool));
+    p->size = 16;
+    p->buffers = calloc(p->size, sizeof(float *));
+    p->lengths = calloc(p->size, sizeof(int));
+    return p;
+}
+
+void free_image_pool(image_pool *p)
+{
+    if (!p) return;
+    if (current_pool == p) current_pool = 0;
+    for (int i = 0; i < p->n; i++) free(p->buffers[i]);
+    free(p->buffers);
+    free(p->lengths);
+    free(p);
+}
+
+// Route image allocations through a pool.
+// image_pool *p: pool to use, or 0 to go back to plain malloc/free.
+void use_image_pool(image_pool *p)
+{
+    current_pool = p;
+}
+
+// Make allocations and frees on the calling thread go to plain
+// malloc/free, without reading the current pool, until turned off again.
+// int on: whether to bypass the pool.
+void bypass_image_pool(int on)
+{
+    pool_bypassed = on;
+}
+
+// Get a buffer of n floats, from the current pool if it has one that size.
+// int zero: whether the buffer has to be cleared.
+float *pool_alloc(int n, int zero)
+{
+    image_pool *p = pool_bypassed ? 0 : current_pool;
+    if (n <= 0) return 0;
+    if (p) {
+        // Most recently released first, it is the most likely to be cached.
+        for (int i = p->n - 1; i >= 0; i--) {
+            if (p->lengths[i] != n) continue;
+            float *data = p->buffers[i];
+            p->n--;
+            p->buffers[i] = p->buffers[p->n];
+            p->lengths[i] = p->lengths[p->n];
+            p->reuses++;
+            if (zero) memset(data, 0, n * sizeof(float));
+            return data;
+        }
+        p->mallocs++;
+    }
+    return zero ? calloc(n, sizeof(float)) : malloc(n * sizeof(float));
+}
+
+// Give a buffer of n floats back to the current pool, or free it.
+void pool_release(float *data, int n)
+{
+    image_pool *p = pool_bypassed ? 0 : current_pool;
+    if (!data) return;
+    if (!p || n <= 0) {
+        free(data);
+        return;
+    }
+    if (p->n == p->size) {
+        p->size *= 2;
+        p->buffers = realloc(p->buffers, p->size * sizeof(float *));
+        p->lengths = realloc(p->lengths, p->size * sizeof(int));
+    }
+    p->buffers[p->n] = data;
+    p->lengths[p->n] = n;
+    p->n++;
+}
+
+// Make an image whose contents are undefined, for buffers that are
+// completely overwritten before being read. Skips zeroing the memory.
+image make_temp_image(int w, int h, int c)
+{
+    image out;
+    out.w = w;
+    out.h = h;
+    out.c = c;
+    out.data = pool_alloc(w*h*c, 0);
+    return out;
+}
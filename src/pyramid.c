@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#include "parallel.h"
+
+// Gaussian and Laplacian pyramids. Level i + 1 is level i blurred with a
+// Gaussian of std dev sigma and then bilinearly resized down by scale, so it
+// lines up with bilinear_resize. Blurring and resizing are fused: every
+// output pixel is one weighted sum over its source pixels, and the blur is
+// only evaluated where the resize reads it.
+//
+// Levels are built the first time they are asked for and kept, so several
+// algorithms working on the same frame can share one pyramid.
+
+typedef struct{
+    int n;          // output samples
+    int taps;       // weights per sample
+    int *index;     // n x taps clamped source indexes
+    float *weight;  // n x taps weights
+} resample_table;
+
+typedef struct{
+    view im;
+    image out;
+    resample_table t;
+} resample_args;
+
+void resample_rows(void *, int, int);
+void resample_columns(void *, int, int);
+
+// The 1d factor of make_gaussian_filter(sigma), normalized.
+float *gaussian_taps(float sigma, int *radius)
+{
+    int size = ceil(sigma * 6);
+    size += size % 2 == 0 ? 1 : 0;
+    int r = size / 2;
+    float *g = calloc(size, sizeof(float));
+    double sum = 0;
+    for (int t = -r; t <= r; t++) {
+        g[t + r] = exp(-(t * t) / (2. * sigma * sigma));
+        sum += g[t + r];
+    }
+    for (int t = 0; t < size; t++) g[t] /= sum;
+    *radius = r;
+    return g;
+}
+
+// Weights that take n clamped samples to m, blurring with g first.
+// Output j reads the blur at (j + .5) * n/m - .5 with linear interpolation,
+// the same place bilinear_resize reads.
+resample_table make_resample_table(int n, int m, float *g, int r)
+{
+    resample_table t;
+    t.n = m;
+    t.taps = 2*r + 2;
+    t.index = calloc(m * t.taps, sizeof(int));
+    t.weight = calloc(m * t.taps, sizeof(float));
+    float factor = 1. * n / m;
+    float shift = factor / 2 - .5;
+    for (int j = 0; j < m; j++) {
+        float x = factor * j + shift;
+        int x_int = floor(x);
+        float d = x - x_int;
+        int k0 = clamp_index(x_int, n);
+        int k1 = clamp_index(x_int + 1, n);
+        int base = k0 - r;
+        int *index = t.index + j * t.taps;
+        float *weight = t.weight + j * t.taps;
+        for (int q = 0; q < t.taps; q++) index[q] = clamp_index(base + q, n);
+        for (int q = 0; q <= 2*r; q++) {
+            weight[q] += (1 - d) * g[q];
+            weight[q + k1 - k0] += d * g[q];
+        }
+    }
+    return t;
+}
+
+void free_resample_table(resample_table t)
+{
+    free(t.index);
+    free(t.weight);
+}
+
+// Horizontal pass over rows [start, end) of all channels stacked.
+void resample_rows(void *ptr, int start, int end)
+{
+    resample_args *args = ptr;
+    view im = args->im;
+    resample_table t = args->t;
+    for (int r = start; r < end; r++) {
+        int c = r / im.h;
+        int y = r % im.h;
+        float *in = view_row(im, y, c);
+        float *out = image_row(args->out, y, c);
+        for (int j = 0; j < t.n; j++) {
+            int *index = t.index + j * t.taps;
+            float *weight = t.weight + j * t.taps;
+            float sum = 0;
+            for (int q = 0; q < t.taps; q++) sum += weight[q] * in[index[q] * im.xs];
+            out[j] = sum;
+        }
+    }
+}
+
+// Vertical pass over output rows [start, end) of all channels stacked,
+// accumulating whole rows so the inner loop runs over contiguous pixels.
+void resample_columns(void *ptr, int start, int end)
+{
+    resample_args *args = ptr;
+    view im = args->im;
+    image out = args->out;
+    resample_table t = args->t;
+    for (int r = start; r < end; r++) {
+        int c = r / out.h;
+        int y = r % out.h;
+        float *dst = image_row(out, y, c);
+        for (int x = 0; x < out.w; x++) dst[x] = 0;
+        for (int q = 0; q < t.taps; q++) {
+            float weight = t.weight[y * t.taps + q];
+            if (weight == 0) continue;
+            float *src = view_row(im, t.index[y * t.taps + q], c);
+            if (im.xs == 1) {
+                for (int x = 0; x < out.w; x++) dst[x] += weight * src[x];
+            } else {
+                for (int x = 0; x < out.w; x++) dst[x] += weight * src[x * im.xs];
+            }
+        }
+    }
+}
+
+// Blur an image with a Gaussian and resize it in one pass, only computing
+// the blur where the resize needs it.
+// view im: image to shrink.
+// int w, h: size of the result.
+// float sigma: std dev. of the Gaussian, in pixels of im.
+// returns: what bilinear_resize gives after convolving with
+//          make_gaussian_filter(sigma).
+image blur_resize(view im, int w, int h, float sigma)
+{
+    int r;
+    float *g = gaussian_taps(sigma, &r);
+    image tmp = make_temp_image(im.w, h, im.c);
+    image out = make_temp_image(w, h, im.c);
+
+    // Columns go first: that pass vectorizes, and it leaves fewer rows for
+    // the gathers of the row pass.
+    resample_args args = {im, tmp, make_resample_table(im.h, h, g, r)};
+    parallel_for(h * im.c, resample_columns, &args);
+    free_resample_table(args.t);
+
+    args.im = image_view(tmp);
+    args.out = out;
+    args.t = make_resample_table(im.w, w, g, r);
+    parallel_for(h * im.c, resample_rows, &args);
+    free_resample_table(args.t);
+
+    free_image(tmp);
+    free(g);
+    return out;
+}
+
+// Make a pyramid over an image. Only level 0 exists until others are asked
+// for.
+// image im: level 0, copied.
+// int levels: number of levels, fewer if the image runs out of pixels.
+// float scale: size ratio between neighboring levels, greater than 1.
+// float sigma: std dev. of the blur before each resize, in pixels of the
+//              finer level.
+// returns: the pyramid, release with free_pyramid.
+pyramid make_pyramid(image im, int levels, float scale, float sigma)
+{
+    assert(scale > 1);
+    pyramid p;
+    p.scale = scale;
+    p.sigma = sigma;
+    p.levels = 1;
+    for (int w = im.w, h = im.h; p.levels < levels && (w > 1 || h > 1); p.levels++) {
+        w = MAX(1, (int)(w / scale + .5));
+        h = MAX(1, (int)(h / scale + .5));
+    }
+    p.gauss = calloc(p.levels, sizeof(image));
+    p.laplace = calloc(p.levels, sizeof(image));
+    p.blur = calloc(p.levels, sizeof(image));
+    p.gauss[0] = copy_image(im);
+    return p;
+}
+
+void free_pyramid(pyramid p)
+{
+    for (int i = 0; i < p.levels; i++) {
+        if (p.gauss[i].data) free_image(p.gauss[i]);
+        if (p.laplace[i].data) free_image(p.laplace[i]);
+        if (p.blur[i].data) free_image(p.blur[i]);
+    }
+    free(p.gauss);
+    free(p.laplace);
+    free(p.blur);
+}
+
+// Level i of the Gaussian pyramid, owned by the pyramid.
+image pyramid_level(pyramid *p, int i)
+{
+    assert(i >= 0 && i < p->levels);
+    if (!p->gauss[i].data) {
+        image finer = pyramid_level(p, i - 1);
+        int w = MAX(1, (int)(finer.w / p->scale + .5));
+        int h = MAX(1, (int)(finer.h / p->scale + .5));
+        if (p->blur[i - 1].data) {
+            // The blur is already there, only the resize is left.
+            p->gauss[i] = bilinear_resize(p->blur[i - 1], w, h);
+        } else {
+            p->gauss[i] = blur_resize(image_view(finer), w, h, p->sigma);
+        }
+    }
+    return p->gauss[i];
+}
+
+// Level i blurred at its own size, the low frequencies of that level.
+// Owned by the pyramid.
+image pyramid_blur(pyramid *p, int i)
+{
+    assert(i >= 0 && i < p->levels);
+    if (!p->blur[i].data) {
+        image f = get_filter(FILTER_GAUSSIAN, p->sigma, 0);
+        p->blur[i] = convolve_image(pyramid_level(p, i), f, 1);
+    }
+    return p->blur[i];
+}
+
+// Level i of the Laplacian pyramid: the Gaussian level minus the next one
+// scaled back up. The last level is the last Gaussian level, so the
+// Laplacian levels add back up to the image. Owned by the pyramid.
+image pyramid_laplacian(pyramid *p, int i)
+{
+    assert(i >= 0 && i < p->levels);
+    if (!p->laplace[i].data) {
+        image level = pyramid_level(p, i);
+        if (i == p->levels - 1) {
+            p->laplace[i] = copy_image(level);
+        } else {
+            image up = bilinear_resize(pyramid_level(p, i + 1), level.w, level.h);
+            for (int k = 0; k < up.w * up.h * up.c; k++) up.data[k] = level.data[k] - up.data[k];
+            p->laplace[i] = up;
+        }
+    }
+    return p->laplace[i];
+}
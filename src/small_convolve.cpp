@@ -0,0 +1,159 @@
+#include "image.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Interior loops of the direct convolution for 3x3, 5x5 and 7x7 filters,
+// with the filter size fixed at compile time so every tap is unrolled. The
+// common 3x3 filters (highpass, sharpen, emboss, gx, gy) also get their taps
+// fixed: zero taps are never loaded and taps of 1 and -1 are plain adds and
+// subtracts.
+//
+// Taps are added in the same order as convolve_span, and a tap of 0, 1 or -1
+// changes a float sum the same way as multiplying by it, so the result is
+// bit for bit what the generic loop gives.
+
+namespace {
+
+#ifdef __SSE2__
+// Sums for 16 neighboring pixels, the strip convolve_span keeps in
+// registers.
+struct block {
+    __m128 s[4];
+};
+
+inline void add_tap(block &b, float w, const float *p)
+{
+    __m128 t = _mm_set1_ps(w);
+    for (int i = 0; i < 4; i++) b.s[i] = _mm_add_ps(b.s[i], _mm_mul_ps(t, _mm_loadu_ps(p + 4*i)));
+}
+#endif
+
+inline void add_tap(float &s, float w, const float *p)
+{
+    s += w * p[0];
+}
+
+// A tap whose weight is known at compile time.
+template <int W> struct tap {
+    template <class S> static inline void add(S &s, const float *p) { add_tap(s, W, p); }
+};
+
+template <> struct tap<0> {
+    template <class S> static inline void add(S &, const float *) {}
+};
+
+template <> struct tap<1> {
+    static inline void add(float &s, const float *p) { s += p[0]; }
+#ifdef __SSE2__
+    static inline void add(block &b, const float *p)
+    {
+        for (int i = 0; i < 4; i++) b.s[i] = _mm_add_ps(b.s[i], _mm_loadu_ps(p + 4*i));
+    }
+#endif
+};
+
+template <> struct tap<-1> {
+    static inline void add(float &s, const float *p) { s -= p[0]; }
+#ifdef __SSE2__
+    static inline void add(block &b, const float *p)
+    {
+        for (int i = 0; i < 4; i++) b.s[i] = _mm_sub_ps(b.s[i], _mm_loadu_ps(p + 4*i));
+    }
+#endif
+};
+
+// Taps I onward of a FW wide filter whose weights W are known, row by row.
+template <int FW, int I, int... W> struct fixed_taps {
+    template <class S> static inline void add(S &, float **, const float *, int) {}
+};
+
+template <int FW, int I, int W0, int... W> struct fixed_taps<FW, I, W0, W...> {
+    template <class S> static inline void add(S &s, float **rows, const float *weights, int x)
+    {
+        tap<W0>::add(s, rows[I / FW] + x + I % FW);
+        fixed_taps<FW, I + 1, W...>::add(s, rows, weights, x);
+    }
+};
+
+// Taps [I, N) of a FW wide filter whose weights are only known at run time.
+template <int FW, int I, int N> struct sized_taps {
+    template <class S> static inline void add(S &s, float **rows, const float *weights, int x)
+    {
+        add_tap(s, weights[I], rows[I / FW] + x + I % FW);
+        sized_taps<FW, I + 1, N>::add(s, rows, weights, x);
+    }
+};
+
+template <int FW, int N> struct sized_taps<FW, N, N> {
+    template <class S> static inline void add(S &, float **, const float *, int) {}
+};
+
+// Convolve pixels [x0, x1) of one output row, see small_filter_span.
+template <int FW, class Taps>
+void small_span(float **rows, float *weights, float *out, int x0, int x1)
+{
+    int w = x0;
+#ifdef __SSE2__
+    for (; w + 16 <= x1; w += 16) {
+        block b = {{_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()}};
+        Taps::add(b, rows, weights, w - FW/2);
+        for (int i = 0; i < 4; i++) _mm_storeu_ps(out + w + 4*i, b.s[i]);
+    }
+#endif
+    for (; w < x1; w++) {
+        float s = 0;
+        Taps::add(s, rows, weights, w - FW/2);
+        out[w] = s;
+    }
+}
+
+template <int K> span_fn sized_span()
+{
+    return small_span<K, sized_taps<K, 0, K*K> >;
+}
+
+#define FIXED_3X3(...) {{__VA_ARGS__}, small_span<3, fixed_taps<3, 0, __VA_ARGS__> >}
+
+// Taps row by row, as the make_*_filter functions set them.
+struct fixed_filter {
+    int taps[9];
+    span_fn span;
+};
+
+const fixed_filter fixed_filters[] = {
+    FIXED_3X3( 0, -1,  0, -1,  4, -1,  0, -1,  0),  // highpass
+    FIXED_3X3( 0, -1,  0, -1,  5, -1,  0, -1,  0),  // sharpen
+    FIXED_3X3(-2, -1,  0, -1,  1,  1,  0,  1,  2),  // emboss
+    FIXED_3X3(-1,  0,  1, -2,  0,  2, -1,  0,  1),  // gx
+    FIXED_3X3(-1, -2, -1,  0,  0,  0,  1,  2,  1),  // gy
+};
+
+}
+
+extern "C" {
+
+// Find a specialized loop for the interior of a convolution.
+// image filter: filter to run, either one channel or one per image channel.
+// returns: a loop that convolves one channel with filter.w x filter.h taps
+//          from contiguous source rows, none of them missing, or 0 when the
+//          filter size has no specialization.
+span_fn small_filter_span(image filter)
+{
+    if (filter.w != filter.h) return 0;
+    if (filter.w == 3 && filter.c == 1) {
+        for (const fixed_filter &f : fixed_filters) {
+            int same = 1;
+            for (int i = 0; i < 9; i++) same &= filter.data[i] == f.taps[i];
+            if (same) return f.span;
+        }
+    }
+    switch (filter.w) {
+        case 3: return sized_span<3>();
+        case 5: return sized_span<5>();
+        case 7: return sized_span<7>();
+    }
+    return 0;
+}
+
+}
@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <float.h>
+#include "image.h"
+#include "parallel.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Statistics are gathered over blocks of rows in parallel, then the blocks
+// are merged in order. The result does not depend on the thread count.
+#define STATS_ROWS 32
+
+typedef struct{
+    view im;
+    int blocks;
+    int bins;
+    float lo, scale;
+    float *min, *max;
+    double *sum, *sumsq;
+    int *hist;
+} stats_args;
+
+void stats_blocks(void *, int, int);
+
+// Accumulate min, max, sum and sum of squares over one row.
+// const float *x: first pixel of the row.
+// int n: pixels in the row.
+// int stride: distance in floats between neighboring pixels.
+void row_stats(const float *x, int n, int stride, float *min, float *max, float *sum, float *sumsq)
+{
+    float mn = *min, mx = *max, s = 0, sq = 0;
+    int i = 0;
+#ifdef __SSE2__
+    if (stride == 1 && n >= 4) {
+        __m128 vmn = _mm_set1_ps(mn), vmx = _mm_set1_ps(mx);
+        __m128 vs = _mm_setzero_ps(), vsq = _mm_setzero_ps();
+        for (; i + 4 <= n; i += 4) {
+            __m128 v = _mm_loadu_ps(x + i);
+            vmn = _mm_min_ps(vmn, v);
+            vmx = _mm_max_ps(vmx, v);
+            vs = _mm_add_ps(vs, v);
+            vsq = _mm_add_ps(vsq, _mm_mul_ps(v, v));
+        }
+        float lanes[4][4];
+        _mm_storeu_ps(lanes[0], vmn);
+        _mm_storeu_ps(lanes[1], vmx);
+        _mm_storeu_ps(lanes[2], vs);
+        _mm_storeu_ps(lanes[3], vsq);
+        for (int k = 0; k < 4; k++) {
+            mn = MIN(mn, lanes[0][k]);
+            mx = MAX(mx, lanes[1][k]);
+            s += lanes[2][k];
+            sq += lanes[3][k];
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        float v = x[i*stride];
+        mn = MIN(mn, v);
+        mx = MAX(mx, v);
+        s += v;
+        sq += v*v;
+    }
+    *min = mn;
+    *max = mx;
+    *sum = s;
+    *sumsq = sq;
+}
+
+// Gather statistics for blocks [start, end), block b covers STATS_ROWS rows
+// of channel b / blocks.
+void stats_blocks(void *ptr, int start, int end)
+{
+    stats_args *args = ptr;
+    view im = args->im;
+    for (int b = start; b < end; b++) {
+        int c = b / args->blocks;
+        int y0 = (b % args->blocks) * STATS_ROWS;
+        int y1 = MIN(y0 + STATS_ROWS, im.h);
+        float mn = FLT_MAX, mx = -FLT_MAX;
+        double sum = 0, sumsq = 0;
+        int *hist = args->bins ? args->hist + b*args->bins : 0;
+
+        for (int y = y0; y < y1; y++) {
+            float *row = view_row(im, y, c);
+            float s, sq;
+            row_stats(row, im.w, im.xs, &mn, &mx, &s, &sq);
+            sum += s;
+            sumsq += sq;
+            if (hist) {
+                for (int x = 0; x < im.w; x++) {
+                    int bin = (row[x*im.xs] - args->lo) * args->scale;
+                    hist[MAX(0, MIN(bin, args->bins - 1))]++;
+                }
+            }
+        }
+        args->min[b] = mn;
+        args->max[b] = mx;
+        args->sum[b] = sum;
+        args->sumsq[b] = sumsq;
+    }
+}
+
+// Compute per channel statistics of a view in one pass.
+// view v: pixels to look at.
+// int bins: number of histogram bins, 0 to skip the histogram.
+// float lo, hi: range of values the histogram covers.
+// returns: statistics, release with free_image_stats.
+image_stats get_view_stats(view v, int bins, float lo, float hi)
+{
+    image_stats s = {0};
+    s.c = v.c;
+    s.n = v.w * v.h;
+    s.bins = MAX(bins, 0);
+    s.lo = lo;
+    s.hi = hi;
+    s.min = calloc(v.c, sizeof(float));
+    s.max = calloc(v.c, sizeof(float));
+    s.mean = calloc(v.c, sizeof(float));
+    s.var = calloc(v.c, sizeof(float));
+    s.sum = calloc(v.c, sizeof(double));
+    s.sumsq = calloc(v.c, sizeof(double));
+    s.hist = s.bins ? calloc(v.c * s.bins, sizeof(int)) : 0;
+    if (s.n == 0) return s;
+
+    stats_args args;
+    args.im = v;
+    args.blocks = (v.h + STATS_ROWS - 1) / STATS_ROWS;
+    args.bins = s.bins;
+    args.lo = lo;
+    args.scale = hi > lo ? s.bins / (hi - lo) : 0;
+    int n = v.c * args.blocks;
+    args.min = calloc(n, sizeof(float));
+    args.max = calloc(n, sizeof(float));
+    args.sum = calloc(n, sizeof(double));
+    args.sumsq = calloc(n, sizeof(double));
+    args.hist = s.bins ? calloc(n * s.bins, sizeof(int)) : 0;
+
+    parallel_for(n, stats_blocks, &args);
+
+    for (int c = 0; c < v.c; c++) {
+        s.min[c] = FLT_MAX;
+        s.max[c] = -FLT_MAX;
+        for (int k = 0; k < args.blocks; k++) {
+            int b = c*args.blocks + k;
+            s.min[c] = MIN(s.min[c], args.min[b]);
+            s.max[c] = MAX(s.max[c], args.max[b]);
+            s.sum[c] += args.sum[b];
+            s.sumsq[c] += args.sumsq[b];
+            for (int i = 0; i < s.bins; i++) {
+                s.hist[c*s.bins + i] += args.hist[b*s.bins + i];
+            }
+        }
+        double mean = s.sum[c] / s.n;
+        double var = s.sumsq[c] / s.n - mean*mean;
+        s.mean[c] = mean;
+        s.var[c] = var > 0 ? var : 0;
+    }
+
+    free(args.min);
+    free(args.max);
+    free(args.sum);
+    free(args.sumsq);
+    free(args.hist);
+    return s;
+}
+
+image_stats get_image_stats(image im, int bins, float lo, float hi)
+{
+    return get_view_stats(image_view(im), bins, lo, hi);
+}
+
+void free_image_stats(image_stats s)
+{
+    free(s.min);
+    free(s.max);
+    free(s.mean);
+    free(s.var);
+    free(s.sum);
+    free(s.sumsq);
+    free(s.hist);
+}
@@ -6,6 +6,7 @@
 #include "image.h"
 #include "test.h"
 #include "args.h"
+#include "parallel.h"
 
 void feature_normalize2(image im)
 {
@@ -76,6 +77,21 @@ void test_get_pixel(){
     free_image(im);
 }
 
+void test_border_index(){
+    TEST(border_index(-1, 5, BORDER_CLAMP) == 0);
+    TEST(border_index(7, 5, BORDER_CLAMP) == 4);
+    TEST(border_index(-1, 5, BORDER_ZERO) == -1);
+    TEST(border_index(-2, 5, BORDER_REFLECT) == 2);
+    TEST(border_index(6, 5, BORDER_REFLECT) == 2);
+    TEST(border_index(-1, 5, BORDER_WRAP) == 4);
+    TEST(border_index(5, 5, BORDER_WRAP) == 0);
+
+    image im = load_image("data/dots.png");
+    TEST(within_eps(PIXEL(im, 1, 0, 1), get_pixel(im, 1, 0, 1)));
+    TEST(within_eps(image_row(im, 1, 2)[3], get_pixel(im, 3, 1, 2)));
+    free_image(im);
+}
+
 void test_set_pixel(){
     image gt = load_image("data/dots.png");
     image d = make_image(4,2,3);
@@ -147,6 +163,105 @@ void test_shift()
     free_image(c);
 }
 
+void test_view()
+{
+    image im = load_image("data/dog.jpg");
+    view crop = crop_view(image_view(im), 40, 30, 64, 48);
+    TEST(within_eps(get_view_pixel(crop, 0, 0, 0), get_pixel(im, 40, 30, 0)));
+    TEST(within_eps(get_view_pixel(crop, 10, 7, 2), get_pixel(im, 50, 37, 2)));
+
+    image copy = view_to_image(crop);
+    image f = make_gaussian_filter(2);
+    image direct = convolve_view(crop, f, 1);
+    image gt = convolve_image(copy, f, 1);
+    TEST(same_image(direct, gt));
+
+    image g = get_channel(im, 1);
+    view ch = channel_view(image_view(im), 1);
+    TEST(within_eps(get_view_pixel(ch, 5, 9, 0), get_pixel(g, 5, 9, 0)));
+    free_image(im);
+    free_image(copy);
+    free_image(f);
+    free_image(direct);
+    free_image(gt);
+    free_image(g);
+}
+
+void test_aligned_view()
+{
+    image im = load_image("data/dog.jpg");
+    view v = image_to_aligned_view(im);
+    TEST(view_is_aligned(v));
+    TEST(v.pw >= im.w && v.pw % VIEW_ALIGN_FLOATS == 0);
+    TEST(within_eps(get_view_pixel(v, 31, 17, 1), get_pixel(im, 31, 17, 1)));
+
+    rgb_to_hsv(im);
+    rgb_to_hsv_view(v);
+    image hsv = view_to_image(v);
+    TEST(same_image(hsv, im));
+
+    free_aligned_view(v);
+    free_image(hsv);
+    free_image(im);
+}
+
+void test_interleaved()
+{
+    image im = load_image("data/dog.jpg");
+    image hwc = load_image_interleaved("data/dog.jpg");
+    TEST(within_eps(get_view_pixel(interleaved_view(hwc), 17, 23, 2), get_pixel(im, 17, 23, 2)));
+
+    image planar = make_image(im.w, im.h, im.c);
+    interleaved_to_planar(hwc, planar);
+    TEST(same_image(planar, im));
+
+    image back = make_image(im.w, im.h, im.c);
+    planar_to_interleaved(planar, back);
+    TEST(same_image(back, hwc));
+
+    rgb_to_hsv(im);
+    rgb_to_hsv_view(interleaved_view(hwc));
+    interleaved_to_planar(hwc, planar);
+    TEST(same_image(planar, im));
+    free_image(im);
+    free_image(hwc);
+    free_image(planar);
+    free_image(back);
+}
+
+void test_pointwise()
+{
+    image im = load_image("data/dog.jpg");
+    image gt = copy_image(im);
+    shift_image(gt, 0, .4);
+    scale_image(gt, 1, 2);
+    shift_image(gt, 2, -.2);
+    clamp_image(gt);
+
+    pointwise p = make_pointwise();
+    pointwise_shift(&p, 0, .4);
+    pointwise_scale(&p, 1, 2);
+    pointwise_shift(&p, 2, -.2);
+    pointwise_clamp(&p);
+    image out = make_image(im.w, im.h, im.c);
+    run_pointwise(p, im, out);
+    TEST(same_image(out, gt));
+
+    run_pointwise(p, im, im);
+    TEST(same_image(im, gt));
+    free_pointwise(p);
+
+    p = make_pointwise();
+    pointwise_add(&p, gt, -1);
+    run_pointwise(p, im, out);
+    TEST(within_eps(out.data[1234], 0) && within_eps(out.data[2*im.w*im.h + 77], 0));
+    free_pointwise(p);
+
+    free_image(im);
+    free_image(gt);
+    free_image(out);
+}
+
 void test_rgb_to_hsv()
 {
     image im = load_image("data/dog.jpg");
@@ -157,6 +272,30 @@ void test_rgb_to_hsv()
     free_image(hsv);
 }
 
+void test_color_simd()
+{
+    image im = load_image("data/dog.jpg");
+    image gray = rgb_to_grayscale(im);
+    image gray_ref = rgb_to_grayscale_scalar(im);
+    TEST(same_image(gray, gray_ref));
+
+    image hsv = copy_image(im);
+    image hsv_ref = copy_image(im);
+    rgb_to_hsv(hsv);
+    rgb_to_hsv_scalar(hsv_ref);
+    TEST(same_image(hsv, hsv_ref));
+
+    hsv_to_rgb(hsv);
+    hsv_to_rgb_scalar(hsv_ref);
+    TEST(same_image(hsv, hsv_ref));
+
+    free_image(im);
+    free_image(gray);
+    free_image(gray_ref);
+    free_image(hsv);
+    free_image(hsv_ref);
+}
+
 void test_hsv_to_rgb()
 {
     image im = load_image("data/dog.jpg");
@@ -227,6 +366,96 @@ void test_bl_resize()
     free_image(gt2);
 }
 
+// Resize pixel by pixel through the interpolation functions.
+image resize_reference(image im, int w, int h, int nn)
+{
+    image out = make_image(w, h, im.c);
+    float xf = 1.*im.w/w, yf = 1.*im.h/h;
+    float xs = xf/2.0 - .5, ys = yf/2.0 - .5;
+    for (int c = 0; c < im.c; ++c) {
+        for (int i = 0; i < h; ++i) {
+            for (int j = 0; j < w; ++j) {
+                float x = xf*j + xs, y = yf*i + ys;
+                float v = nn ? nn_interpolate(im, x, y, c) : bilinear_interpolate(im, x, y, c);
+                set_pixel(out, j, i, c, v);
+            }
+        }
+    }
+    return out;
+}
+
+void test_resize_views()
+{
+    image im = load_image("data/dog.jpg");
+    image hwc = make_image(im.w, im.h, im.c);
+    planar_to_interleaved(im, hwc);
+    int sizes[][2] = {{37, 29}, {im.w*3, im.h/2}, {1, 1}};
+    for (int s = 0; s < 3; ++s) {
+        for (int nn = 0; nn < 2; ++nn) {
+            int w = sizes[s][0], h = sizes[s][1];
+            image gt = resize_reference(im, w, h, nn);
+            image out = nn ? nn_resize(im, w, h) : bilinear_resize(im, w, h);
+            TEST(same_image(out, gt));
+            free_image(out);
+            view v = interleaved_view(hwc);
+            out = nn ? nn_resize_view(v, w, h) : bilinear_resize_view(v, w, h);
+            TEST(same_image(out, gt));
+            free_image(out);
+            free_image(gt);
+        }
+    }
+    free_image(hwc);
+    free_image(im);
+}
+
+// Average the source area under every output pixel, one pixel at a time.
+image area_reference(image im, int w, int h)
+{
+    image out = make_image(w, h, im.c);
+    double xf = 1.*im.w/w, yf = 1.*im.h/h;
+    for (int c = 0; c < im.c; ++c) {
+        for (int i = 0; i < h; ++i) {
+            for (int j = 0; j < w; ++j) {
+                double sum = 0;
+                for (int y = floor(i*yf); y < MIN(im.h, ceil((i+1)*yf)); ++y) {
+                    double wy = MIN(y+1, (i+1)*yf) - MAX(y, i*yf);
+                    for (int x = floor(j*xf); x < MIN(im.w, ceil((j+1)*xf)); ++x) {
+                        double wx = MIN(x+1, (j+1)*xf) - MAX(x, j*xf);
+                        if (wx > 0 && wy > 0) sum += wx*wy*get_pixel(im, x, y, c);
+                    }
+                }
+                set_pixel(out, j, i, c, sum/(xf*yf));
+            }
+        }
+    }
+    return out;
+}
+
+void test_area_resize()
+{
+    image dog = load_image("data/dog.jpg");
+    image im = bilinear_resize(dog, 320, 240);
+    image hwc = make_image(im.w, im.h, im.c);
+    planar_to_interleaved(im, hwc);
+    int sizes[][2] = {{160, 120}, {80, 60}, {40, 30}, {37, 29}, {320, 240}, {500, 300}, {1, 1}};
+    for (int s = 0; s < 7; ++s) {
+        int w = sizes[s][0], h = sizes[s][1];
+        image gt = area_reference(im, w, h);
+        image out = area_resize(im, w, h);
+        TEST(same_image(out, gt));
+        free_image(out);
+        out = area_resize_view(interleaved_view(hwc), w, h);
+        TEST(same_image(out, gt));
+        free_image(out);
+        free_image(gt);
+    }
+    image none = area_resize(im, 0, 5);
+    TEST(none.w == 0 && none.h == 5 && !none.data);
+    free_image(hwc);
+    free_image(im);
+    free_image(dog);
+}
+
 void test_multiple_resize()
 {
     image im = load_image("data/dog.jpg");
@@ -318,6 +547,332 @@ void test_gaussian_filter(){
     free_image(gt);
 }
 
+void test_filter_cache(){
+    image g = get_filter(FILTER_GAUSSIAN, 2, 0);
+    image gt = make_gaussian_filter(2);
+    TEST(same_image(g, gt));
+    TEST(get_filter(FILTER_GAUSSIAN, 2, 0).data == g.data);
+    TEST(get_filter(FILTER_GAUSSIAN, 2, 5).data == g.data);
+    TEST(get_filter(FILTER_GAUSSIAN, 1, 0).data != g.data);
+    TEST(get_filter(FILTER_GAUSSIAN_1D, 2, 0).data != g.data);
+    free_image(gt);
+
+    image b = get_filter(FILTER_BOX, 0, 5);
+    gt = make_box_filter(5);
+    TEST(same_image(b, gt));
+    TEST(get_filter(FILTER_BOX, 3, 5).data == b.data);
+    TEST(get_filter(FILTER_BOX, 0, 3).w == 3);
+    free_image(gt);
+
+    // Callers must not free cached filters. Under a pool a freed filter
+    // would be handed out again and overwritten.
+    image_pool *pool = make_image_pool();
+    use_image_pool(pool);
+    image im = load_image("data/dog.jpg");
+    image sobel = colorize_sobel(im);
+    image reuse = make_image(g.w, g.h, g.c);
+    gt = make_gaussian_filter(2);
+    TEST(same_image(get_filter(FILTER_GAUSSIAN, 2, 0), gt));
+    free_image(gt);
+    free_image(reuse);
+    free_image(sobel);
+    free_image(im);
+
+    // New filters never come from the pool, which other threads could not
+    // touch safely.
+    int mallocs = pool->mallocs, reuses = pool->reuses;
+    image f = get_filter(FILTER_GAUSSIAN, 3.5, 0);
+    TEST(pool->mallocs == mallocs && pool->reuses == reuses);
+    gt = make_gaussian_filter(3.5);
+    TEST(same_image(f, gt));
+    free_image(gt);
+    use_image_pool(0);
+    free_image_pool(pool);
+}
+
+image convolve_reference_border(image im, image f, int preserve, BORDER border)
+{
+    image out = make_image(im.w, im.h, preserve ? im.c : 1);
+    for (int c = 0; c < im.c; ++c) {
+        int fc = f.c == im.c ? c : 0;
+        for (int y = 0; y < im.h; ++y) {
+            for (int x = 0; x < im.w; ++x) {
+                float sum = 0;
+                for (int j = 0; j < f.h; ++j) {
+                    for (int i = 0; i < f.w; ++i) {
+                        int sx = border_index(x + i - f.w/2, im.w, border);
+                        int sy = border_index(y + j - f.h/2, im.h, border);
+                        if (sx < 0 || sy < 0) continue;
+                        sum += get_pixel(f, i, j, fc) * get_pixel(im, sx, sy, c);
+                    }
+                }
+                out.data[x + y*im.w + (preserve ? c : 0)*im.w*im.h] += sum;
+            }
+        }
+    }
+    return out;
+}
+
+image convolve_reference(image im, image f, int preserve)
+{
+    return convolve_reference_border(im, f, preserve, BORDER_CLAMP);
+}
+
+void test_convolve_border(){
+    image im = load_image("data/dogsmall.jpg");
+    image tiny = make_image(3, 2, 1);
+    for (int i = 0; i < 6; ++i) tiny.data[i] = i/6.;
+
+    image full = make_image(5, 5, 1);
+    for (int i = 0; i < 25; ++i) full.data[i] = ((i*7) % 11 - 5) / 10.;
+    image sep = make_image(5, 3, 1);
+    for (int y = 0; y < 3; ++y) {
+        for (int x = 0; x < 5; ++x) set_pixel(sep, x, y, 0, (y + 1) * (x - 1.5));
+    }
+
+    BORDER modes[] = {BORDER_CLAMP, BORDER_ZERO, BORDER_REFLECT, BORDER_WRAP};
+    for (int m = 0; m < 4; ++m) {
+        for (int fft = 0; fft < 2; ++fft) {
+            if (fft) set_fft_threshold(1);
+            image gt = convolve_reference_border(im, full, 1, modes[m]);
+            image out = convolve_image_border(im, full, 1, modes[m]);
+            TEST(same_image(out, gt));
+            free_image(gt);
+            free_image(out);
+
+            gt = convolve_reference_border(tiny, full, 1, modes[m]);
+            out = convolve_image_border(tiny, full, 1, modes[m]);
+            TEST(same_image(out, gt));
+            free_image(gt);
+            free_image(out);
+            set_fft_threshold(0);
+        }
+        image gt = convolve_reference_border(im, sep, 0, modes[m]);
+        image out = convolve_image_border(im, sep, 0, modes[m]);
+        TEST(same_image(out, gt));
+        free_image(gt);
+        free_image(out);
+    }
+
+    free_image(im);
+    free_image(tiny);
+    free_image(full);
+    free_image(sep);
+}
+
+void test_separable_convolution(){
+    image im = load_image("data/dogsmall.jpg");
+    float col[3] = {1, -2, .5};
+    float row[5] = {.1, .2, .4, .2, .1};
+    image f = make_image(5, 3, 3);
+    for (int c = 0; c < 3; ++c) {
+        for (int y = 0; y < 3; ++y) {
+            for (int x = 0; x < 5; ++x) {
+                set_pixel(f, x, y, c, (c + 1) * col[y] * row[x]);
+            }
+        }
+    }
+    image gt = convolve_reference(im, f, 1);
+    image out = convolve_image(im, f, 1);
+    TEST(same_image(out, gt));
+    free_image(gt);
+    free_image(out);
+
+    gt = convolve_reference(im, f, 0);
+    out = convolve_image(im, f, 0);
+    TEST(same_image(out, gt));
+    free_image(gt);
+    free_image(out);
+
+    // Rank 2, has to take the full 2d path.
+    set_pixel(f, 0, 0, 1, 3);
+    gt = convolve_reference(im, f, 1);
+    out = convolve_image(im, f, 1);
+    TEST(same_image(out, gt));
+
+    free_image(im);
+    free_image(f);
+    free_image(gt);
+    free_image(out);
+}
+
+void test_tiled_convolution(){
+    // Wider than one tile, with per channel taps that have no rank 1 split.
+    image im = load_image("data/dog.jpg");
+    image f = make_image(7, 5, 3);
+    for (int i = 0; i < f.w*f.h*f.c; ++i) f.data[i] = ((i*13) % 9 - 4) / 20.;
+    image gt = convolve_reference(im, f, 1);
+    image out = convolve_image(im, f, 1);
+    TEST(same_image(out, gt));
+    free_image(gt);
+    free_image(out);
+
+    gt = convolve_reference(im, f, 0);
+    out = convolve_image(im, f, 0);
+    TEST(same_image(out, gt));
+    free_image(out);
+
+    // Interleaved pixels take the scalar loop.
+    image hwc = load_image_interleaved("data/dog.jpg");
+    out = convolve_view(interleaved_view(hwc), f, 0);
+    TEST(same_image(out, gt));
+
+    free_image(im);
+    free_image(f);
+    free_image(gt);
+    free_image(out);
+    free_image(hwc);
+}
+
+void test_small_filters(){
+    image im = load_image("data/dogsmall.jpg");
+    image fixed[] = {make_highpass_filter(), make_sharpen_filter(), make_emboss_filter(),
+                     make_gx_filter(), make_gy_filter()};
+    BORDER modes[] = {BORDER_CLAMP, BORDER_ZERO};
+    for (int m = 0; m < 2; ++m) {
+        for (int i = 0; i < 5; ++i) {
+            image gt = convolve_reference_border(im, fixed[i], 0, modes[m]);
+            image out = convolve_image_border(im, fixed[i], 0, modes[m]);
+            TEST(same_image(out, gt));
+            free_image(gt);
+            free_image(out);
+        }
+        // Sizes with unrolled loops but taps only known at run time.
+        for (int k = 3; k <= 7; k += 2) {
+            image f = make_image(k, k, 3);
+            for (int i = 0; i < k*k*3; ++i) f.data[i] = ((i*13) % 9 - 4) / 20.;
+            image gt = convolve_reference_border(im, f, 1, modes[m]);
+            image out = convolve_image_border(im, f, 1, modes[m]);
+            TEST(same_image(out, gt));
+            free_image(gt);
+            free_image(out);
+            free_image(f);
+        }
+    }
+    for (int i = 0; i < 5; ++i) free_image(fixed[i]);
+    free_image(im);
+}
+
+image median_reference(image im, int size)
+{
+    int r = size/2;
+    float *v = calloc(size*size, sizeof(float));
+    image out = make_image(im.w, im.h, im.c);
+    for (int c = 0; c < im.c; ++c) {
+        for (int y = 0; y < im.h; ++y) {
+            for (int x = 0; x < im.w; ++x) {
+                int n = 0;
+                for (int dy = -r; dy <= r; ++dy) {
+                    for (int dx = -r; dx <= r; ++dx) {
+                        float p = get_pixel(im, x + dx, y + dy, c);
+                        int i = n++;
+                        for (; i > 0 && v[i-1] > p; --i) v[i] = v[i-1];
+                        v[i] = p;
+                    }
+                }
+                set_pixel(out, x, y, c, v[n/2]);
+            }
+        }
+    }
+    free(v);
+    return out;
+}
+
+void test_median_filter(){
+    // Salt and pepper noise, and an image narrower than the biggest window.
+    image im = load_image("data/dogsmall.jpg");
+    for (int i = 0; i < im.w*im.h*im.c; i += 7) im.data[i] = (i/7) % 2;
+    image tiny = make_image(5, 4, 2);
+    for (int i = 0; i < 5*4*2; ++i) tiny.data[i] = ((i*37) % 23) / 255.;
+
+    int sizes[] = {1, 3, 5, 7, 15};
+    for (int s = 0; s < 5; ++s) {
+        image gt = median_reference(im, sizes[s]);
+        image out = median_image(image_view(im), sizes[s]);
+        TEST(same_image(out, gt));
+        free_image(gt);
+        free_image(out);
+
+        gt = median_reference(tiny, sizes[s]);
+        out = median_image(image_view(tiny), sizes[s]);
+        TEST(same_image(out, gt));
+        free_image(gt);
+        free_image(out);
+    }
+
+    // Interleaved pixels read with a stride.
+    image hwc = make_image(im.w, im.h, im.c);
+    planar_to_interleaved(im, hwc);
+    image gt = median_reference(im, 5);
+    image out = median_image(interleaved_view(hwc), 5);
+    TEST(same_image(out, gt));
+    free_image(gt);
+    free_image(out);
+    gt = median_reference(im, 9);
+    out = median_image(interleaved_view(hwc), 9);
+    TEST(same_image(out, gt));
+    free_image(gt);
+    free_image(out);
+
+    free_image(hwc);
+    free_image(tiny);
+    free_image(im);
+}
+
+void test_filter_bank(){
+    image im = load_image("data/dogsmall.jpg");
+    image f[4];
+    f[0] = make_gx_filter();
+    f[1] = make_gy_filter();
+    f[2] = make_image(5, 3, 3);
+    for (int i = 0; i < 5*3*3; ++i) f[2].data[i] = ((i*17) % 11 - 5) / 10.;
+    f[3] = make_highpass_filter();
+
+    for (int preserve = 0; preserve < 2; ++preserve) {
+        for (int n = 2; n <= 4; n += 2) {
+            image *out = convolve_bank(image_view(im), f, n, preserve, BORDER_REFLECT);
+            for (int k = 0; k < n; ++k) {
+                image gt = convolve_image_border(im, f[k], preserve, BORDER_REFLECT);
+                TEST(same_image(out[k], gt));
+                free_image(gt);
+                free_image(out[k]);
+            }
+            free(out);
+        }
+    }
+
+    free_image(im);
+    for (int k = 0; k < 4; ++k) free_image(f[k]);
+}
+
+void test_fft_convolution(){
+    image im = load_image("data/dogsmall.jpg");
+    image f = make_image(25, 25, 1);
+    for (int i = 0; i < f.w*f.h; ++i) f.data[i] = ((i*7919) % 13 - 6) / 100.;
+    set_fft_threshold(1);
+    image gt = convolve_reference(im, f, 1);
+    image out = convolve_image(im, f, 1);
+    set_fft_threshold(0);
+    TEST(same_image(out, gt));
+    free_image(gt);
+    free_image(out);
+    free_image(f);
+
+    // Per channel filters, with odd sizes that need padding.
+    f = make_image(4, 3, 3);
+    for (int i = 0; i < f.w*f.h*f.c; ++i) f.data[i] = ((i*31) % 7 - 3) / 10.;
+    set_fft_threshold(1);
+    gt = convolve_reference(im, f, 0);
+    out = convolve_image(im, f, 0);
+    set_fft_threshold(0);
+    TEST(same_image(out, gt));
+
+    free_image(im);
+    free_image(f);
+    free_image(gt);
+    free_image(out);
+}
+
 void test_gaussian_blur(){
     image im = load_image("data/dog.jpg");
     image f = make_gaussian_filter(2);
@@ -377,6 +932,123 @@ void test_frequency_image(){
     free_image(high_freq);
 }
 
+void test_pyramid(){
+    image im = load_image("data/dog.jpg");
+    pyramid p = make_pyramid(im, 4, 2, 2);
+
+    // The same size blur of level 0 is the low frequency image.
+    image low = copy_image(pyramid_blur(&p, 0));
+    clamp_image(low);
+    image gt = load_image("figs/low-frequency.png");
+    TEST(same_image(low, gt));
+    free_image(low);
+    free_image(gt);
+
+    // Level 1 comes from that blur, the fused kernel has to agree with it.
+    image level = pyramid_level(&p, 1);
+    TEST(level.w == 384 && level.h == 288);
+    image fused = blur_resize(image_view(im), level.w, level.h, 2);
+    TEST(same_image(fused, level));
+    free_image(fused);
+
+    // Asking for a coarse level first goes through the fused kernel only.
+    pyramid q = make_pyramid(im, 4, 2, 2);
+    TEST(same_image(pyramid_level(&q, 3), pyramid_level(&p, 3)));
+    free_pyramid(q);
+
+    // The Laplacian levels add back up to the image.
+    image rec = copy_image(pyramid_laplacian(&p, p.levels - 1));
+    for (int i = p.levels - 2; i >= 0; --i) {
+        image lap = pyramid_laplacian(&p, i);
+        image up = bilinear_resize(rec, lap.w, lap.h);
+        free_image(rec);
+        rec = add_image(up, lap);
+        free_image(up);
+    }
+    TEST(same_image(rec, im));
+    free_image(rec);
+    free_pyramid(p);
+
+    image tiny = make_image(3, 2, 1);
+    p = make_pyramid(tiny, 10, 2, 1);
+    TEST(p.levels == 3);
+    TEST(pyramid_level(&p, 2).w == 1 && pyramid_level(&p, 2).h == 1);
+    free_pyramid(p);
+    free_image(tiny);
+    free_image(im);
+}
+
+void test_image_stats(){
+    image im = make_image(3, 2, 2);
+    for (int i = 0; i < 6; ++i) {
+        im.data[i] = i;
+        im.data[6 + i] = .5;
+    }
+    image_stats s = get_image_stats(im, 3, 0, 6);
+    TEST(s.n == 6);
+    TEST(within_eps(s.min[0], 0) && within_eps(s.max[0], 5));
+    TEST(within_eps(s.mean[0], 2.5) && within_eps(s.var[0], 35./12));
+    TEST(within_eps(s.mean[1], .5) && within_eps(s.var[1], 0));
+    TEST(s.hist[0] == 2 && s.hist[1] == 2 && s.hist[2] == 2);
+    TEST(s.hist[3] == 6 && s.hist[4] == 0);
+    free_image_stats(s);
+
+    feature_normalize(im);
+    TEST(within_eps(im.data[0], 0) && within_eps(im.data[5], 1) && within_eps(im.data[2], .4));
+    TEST(within_eps(im.data[6], 0));
+    free_image(im);
+
+    im = load_image("data/dog.jpg");
+    image gray = rgb_to_grayscale(im);
+    image gt = copy_image(gray);
+    feature_normalize2(gt);
+    feature_normalize(gray);
+    TEST(same_image(gray, gt));
+
+    l1_normalize(im);
+    s = get_image_stats(im, 0, 0, 0);
+    TEST(within_eps(s.sum[0] + s.sum[1] + s.sum[2], 1));
+    free_image_stats(s);
+    free_image(im);
+    free_image(gray);
+    free_image(gt);
+}
+
+void test_sobel_gradients(){
+    image im = load_image("data/dogsmall.jpg");
+    image fx = make_gx_filter();
+    image fy = make_gy_filter();
+    image gt_x = convolve_reference(im, fx, 0);
+    image gt_y = convolve_reference(im, fy, 0);
+
+    image gx = make_image(im.w, im.h, 1);
+    image gy = make_image(im.w, im.h, 1);
+    image mag = make_image(im.w, im.h, 1);
+    image dir = make_image(im.w, im.h, 1);
+    sobel_gradients(image_view(im), gx, gy, mag, dir);
+    TEST(same_image(gx, gt_x));
+    TEST(same_image(gy, gt_y));
+
+    int i, bad_mag = 0, bad_dir = 0;
+    for (i = 0; i < im.w*im.h; ++i) {
+        float x = gx.data[i], y = gy.data[i];
+        if (fabs(mag.data[i] - sqrt(x*x + y*y)) > 1e-4) ++bad_mag;
+        if (fabs(dir.data[i] - atan2(y, x)) > 1e-4) ++bad_dir;
+    }
+    TEST(bad_mag == 0);
+    TEST(bad_dir == 0);
+
+    free_image(im);
+    free_image(fx);
+    free_image(fy);
+    free_image(gt_x);
+    free_image(gt_y);
+    free_image(gx);
+    free_image(gy);
+    free_image(mag);
+    free_image(dir);
+}
+
 void test_sobel(){
     image im = load_image("data/dog.jpg");
     image *res = sobel_image(im);
@@ -427,6 +1099,39 @@ void test_structure()
     free_image(gt);
 }
 
+void test_recursive_gaussian()
+{
+    image im = load_image("data/dogsmall.jpg");
+    float sigmas[] = {1, 2.5, 6};
+    for (int i = 0; i < 3; ++i) {
+        image f = make_gaussian_filter(sigmas[i]);
+        image gt = convolve_image(im, f, 1);
+        image out = recursive_gaussian(im, sigmas[i]);
+        TEST(same_image(out, gt));
+        free_image(f);
+        free_image(gt);
+        free_image(out);
+    }
+
+    // Flat images stay flat, right up to the border.
+    image flat = make_image(37, 23, 1);
+    for (int i = 0; i < flat.w*flat.h; ++i) flat.data[i] = .7;
+    image out = recursive_gaussian(flat, 4);
+    TEST(same_image(out, flat));
+    free_image(out);
+
+    set_smooth_mode(SMOOTH_RECURSIVE);
+    out = smooth_image(im, 2);
+    set_smooth_mode(SMOOTH_EXACT);
+    image gt = smooth_image(im, 2);
+    TEST(same_image(out, gt));
+
+    free_image(im);
+    free_image(flat);
+    free_image(out);
+    free_image(gt);
+}
+
 void test_cornerness()
 {
     image im = load_image("data/dogbw.png");
@@ -497,6 +1202,127 @@ void test_compute_homography()
     free_matrix(Hp);
 }
 
+void test_box_filter()
+{
+    image im = load_image("data/dogsmall.jpg");
+    image tiny = make_image(3, 2, 2);
+    for (int i = 0; i < 12; ++i) tiny.data[i] = i/12.;
+
+    BORDER modes[] = {BORDER_CLAMP, BORDER_ZERO, BORDER_REFLECT, BORDER_WRAP};
+    int sizes[][2] = {{15, 15}, {4, 6}, {1, 5}};
+    for (int m = 0; m < 4; ++m) {
+        for (int k = 0; k < 3; ++k) {
+            int fw = sizes[k][0], fh = sizes[k][1];
+            image f = make_image(fw, fh, 1);
+            for (int i = 0; i < fw*fh; ++i) f.data[i] = 1./(fw*fh);
+            image gt = convolve_reference_border(im, f, 1, modes[m]);
+            image out = copy_image(im);
+            box_sum(image_view(out), out, fw, fh, 1./(fw*fh), modes[m]);
+            TEST(same_image(out, gt));
+            free_image(gt);
+            free_image(out);
+
+            // Windows bigger than the image.
+            gt = convolve_reference_border(tiny, f, 1, modes[m]);
+            out = copy_image(tiny);
+            box_sum(image_view(out), out, fw, fh, 1./(fw*fh), modes[m]);
+            TEST(same_image(out, gt));
+            free_image(gt);
+            free_image(out);
+            free_image(f);
+        }
+    }
+
+    image f = make_box_filter(15);
+    image gt = convolve_reference(im, f, 1);
+    image out = box_filter_image(im, 15);
+    TEST(same_image(out, gt));
+    free_image(out);
+    out = convolve_image(im, f, 1);
+    TEST(same_image(out, gt));
+
+    free_image(im);
+    free_image(tiny);
+    free_image(f);
+    free_image(gt);
+    free_image(out);
+}
+
+void test_image_pool()
+{
+    image a_full = load_image("data/dog_a.jpg");
+    image b_full = load_image("data/dog_b.jpg");
+    image a = bilinear_resize(a_full, a_full.w/4, a_full.h/4);
+    image b = bilinear_resize(b_full, b_full.w/4, b_full.h/4);
+    free_image(a_full);
+    free_image(b_full);
+    image gt = optical_flow_images(b, a, 15, 8);
+
+    image_pool *pool = make_image_pool();
+    use_image_pool(pool);
+    image v = optical_flow_images(b, a, 15, 8);
+    TEST(same_image(v, gt));
+    free_image(v);
+
+    int mallocs = pool->mallocs;
+    v = optical_flow_images(b, a, 15, 8);
+    TEST(pool->mallocs == mallocs);
+    TEST(pool->reuses > 0);
+    TEST(same_image(v, gt));
+    free_image(v);
+    use_image_pool(0);
+    free_image_pool(pool);
+
+    free_image(a);
+    free_image(b);
+    free_image(gt);
+}
+
+void test_parallel()
+{
+    image im = load_image("data/dog.jpg");
+    image a_full = load_image("data/dog_a.jpg");
+    image b_full = load_image("data/dog_b.jpg");
+    image f = make_gaussian_filter(2);
+
+    set_num_threads(1);
+    image a = bilinear_resize(a_full, a_full.w/4, a_full.h/4);
+    image b = bilinear_resize(b_full, b_full.w/4, b_full.h/4);
+    image blur = convolve_image(im, f, 1);
+    image hsv = copy_image(im);
+    rgb_to_hsv(hsv);
+    image flow = optical_flow_images(b, a, 15, 8);
+
+    set_num_threads(4);
+    image a4 = bilinear_resize(a_full, a_full.w/4, a_full.h/4);
+    image b4 = bilinear_resize(b_full, b_full.w/4, b_full.h/4);
+    image blur4 = convolve_image(im, f, 1);
+    image hsv4 = copy_image(im);
+    rgb_to_hsv(hsv4);
+    image flow4 = optical_flow_images(b4, a4, 15, 8);
+    set_num_threads(0);
+
+    TEST(same_image(a, a4));
+    TEST(same_image(blur, blur4));
+    TEST(same_image(hsv, hsv4));
+    TEST(same_image(flow, flow4));
+
+    free_image(im);
+    free_image(a_full);
+    free_image(b_full);
+    free_image(f);
+    free_image(a);
+    free_image(b);
+    free_image(blur);
+    free_image(hsv);
+    free_image(flow);
+    free_image(a4);
+    free_image(b4);
+    free_image(blur4);
+    free_image(hsv4);
+    free_image(flow4);
+}
+
 void test_activate_matrix()
 {
     matrix a = load_matrix("data/test/a.matrix");
@@ -663,16 +1489,85 @@ void make_matrix_test()
     save_matrix(l.v, "data/test/updated_v.matrix");
 }
 
+void test_typed_image()
+{
+    image im = load_image("data/dog.jpg");
+    typed_image u8 = load_typed_image("data/dog.jpg", PIXEL_U8);
+    image back = typed_to_image(u8);
+    TEST(same_image(back, im));
+    free_image(back);
+
+    typed_image small = load_typed_image("data/dogsmall.jpg", PIXEL_U8);
+    typed_image big = nn_resize_typed(small, small.w*4, small.h*4);
+    image resized = typed_to_image(big);
+    image gt = load_image("figs/dog4x-nn-for-test.png");
+    TEST(same_image(resized, gt));
+    free_typed_image(small);
+    free_typed_image(big);
+    free_image(resized);
+    free_image(gt);
+
+    typed_image half = image_to_typed(im, PIXEL_F16);
+    image f = make_gaussian_filter(2);
+    typed_image blur = convolve_typed(half, f, 1);
+    image blurred = typed_to_image(blur);
+    image blur_gt = convolve_image(im, f, 1);
+    TEST(same_image(blurred, blur_gt));
+    free_typed_image(half);
+    free_typed_image(blur);
+    free_image(blurred);
+    free_image(blur_gt);
+    free_image(f);
+
+    // Integer filters on 8 bit pixels run in fixed point, byte for byte the
+    // same as the float loop.
+    image filters[] = {make_gx_filter(), make_emboss_filter(), make_sharpen_filter(), make_highpass_filter()};
+    for (int i = 0; i < 4; ++i) {
+        for (int preserve = 0; preserve < 2; ++preserve) {
+            typed_image fixed = convolve_typed(u8, filters[i], preserve);
+            image im8 = typed_to_image(u8);
+            image conv = convolve_image(im8, filters[i], preserve);
+            typed_image conv8 = image_to_typed(conv, PIXEL_U8);
+            TEST(0 == memcmp(fixed.data, conv8.data, conv.w*conv.h*conv.c));
+            free_typed_image(fixed);
+            free_typed_image(conv8);
+            free_image(im8);
+            free_image(conv);
+        }
+        free_image(filters[i]);
+    }
+
+    typed_image u16 = image_to_typed(im, PIXEL_U16);
+    typed_image gray = rgb_to_grayscale_typed(u16);
+    image gray_f = typed_to_image(gray);
+    image gray_gt = rgb_to_grayscale(im);
+    TEST(same_image(gray_f, gray_gt));
+    free_typed_image(u16);
+    free_typed_image(gray);
+    free_image(gray_f);
+    free_image(gray_gt);
+
+    free_typed_image(u8);
+    free_image(im);
+}
+
 void test_hw0()
 {
     test_get_pixel();
+    test_border_index();
     test_set_pixel();
     test_copy();
     test_shift();
     test_clamp();
+    test_pointwise();
     test_grayscale();
+    test_view();
+    test_aligned_view();
+    test_interleaved();
     test_rgb_to_hsv();
     test_hsv_to_rgb();
+    test_color_simd();
+    test_typed_image();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw1()
@@ -681,32 +1576,113 @@ void test_hw1()
     test_nn_resize();
     test_bl_interpolate();
     test_bl_resize();
+    test_resize_views();
+    test_area_resize();
     test_multiple_resize();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw2()
 {
     test_gaussian_filter();
+    test_filter_cache();
     test_sharpen_filter();
     test_emboss_filter();
     test_highpass_filter();
     test_convolution();
+    test_separable_convolution();
+    test_tiled_convolution();
+    test_small_filters();
+    test_filter_bank();
+    test_median_filter();
+    test_fft_convolution();
+    test_convolve_border();
     test_gaussian_blur();
     test_hybrid_image();
     test_frequency_image();
+    test_pyramid();
+    test_image_stats();
+    test_sobel_gradients();
     test_sobel();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw3()
 {
     test_structure();
+    test_recursive_gaussian();
     test_cornerness();
     test_projection();
     test_compute_homography();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
+typedef struct{
+    image *frames;
+    int n, next;
+    int shown, esc_at;
+} fake_stream;
+
+fake_stream *current_stream = 0;
+
+image next_fake_frame(void *p)
+{
+    fake_stream *s = p;
+    if (s->next == s->n) {
+        image none = {0};
+        return none;
+    }
+    return copy_image(s->frames[s->next++]);
+}
+
+int show_fake_frame(image im, const char *name, int ms)
+{
+    return ++current_stream->shown == current_stream->esc_at ? 27 : -1;
+}
+
+// Whether every buffer in the pool is a different one, as it would not be
+// after releasing the same image twice.
+int pool_buffers_distinct(image_pool *pool)
+{
+    for (int i = 0; i < pool->n; i++) {
+        for (int j = i + 1; j < pool->n; j++) {
+            if (pool->buffers[i] == pool->buffers[j]) return 0;
+        }
+    }
+    return 1;
+}
+
+void test_flow_stream()
+{
+    image a_full = load_image("data/dog_a.jpg");
+    image b_full = load_image("data/dog_b.jpg");
+    image frames[3];
+    frames[0] = bilinear_resize(a_full, a_full.w/4, a_full.h/4);
+    frames[1] = bilinear_resize(b_full, b_full.w/4, b_full.h/4);
+    frames[2] = copy_image(frames[0]);
+    free_image(a_full);
+    free_image(b_full);
+
+    // ESC on the first frame, with the last frame still held, and then
+    // running out of frames.
+    for (int esc_at = 1; esc_at >= 0; esc_at--) {
+        fake_stream s = {frames, 3, 0, 0, esc_at};
+        current_stream = &s;
+        image_pool *pool = make_image_pool();
+        use_image_pool(pool);
+        optical_flow_stream(&s, next_fake_frame, show_fake_frame, 15, 8, 1);
+        use_image_pool(0);
+        TEST(s.shown == (esc_at ? 1 : 2));
+        TEST(pool_buffers_distinct(pool));
+        free_image_pool(pool);
+    }
+    current_stream = 0;
+    for (int i = 0; i < 3; i++) free_image(frames[i]);
+}
+
 void test_hw4()
 {
+    test_box_filter();
+    test_image_pool();
+    test_flow_stream();
+    test_parallel();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw5()
@@ -720,6 +1696,7 @@ void test_hw5()
 void run_tests()
 {
     test_structure();
+    test_recursive_gaussian();
     test_cornerness();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
\ No newline at end of file
@@ -0,0 +1,547 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#include "parallel.h"
+#include "stb_image.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Typed images hold the same [0,1] values as float images in less memory.
+// Kernels read a few rows at a time into float scratch rows, do their math
+// in float, and round and saturate on the way back out.
+
+int pixel_size(PIXEL_TYPE type)
+{
+    switch (type) {
+        case PIXEL_U8: return 1;
+        case PIXEL_U16: return 2;
+        case PIXEL_F16: return 2;
+        default: return 4;
+    }
+}
+
+typed_image make_typed_image(int w, int h, int c, PIXEL_TYPE type)
+{
+    typed_image im;
+    im.w = w;
+    im.h = h;
+    im.c = c;
+    im.type = type;
+    im.data = calloc(w*h*c, pixel_size(type));
+    return im;
+}
+
+void free_typed_image(typed_image im)
+{
+    free(im.data);
+}
+
+// IEEE half precision conversions, round to nearest even.
+float half_to_float(unsigned short h)
+{
+    unsigned int sign = (h & 0x8000) << 16;
+    unsigned int exp = (h >> 10) & 0x1f;
+    unsigned int mant = h & 0x3ff;
+    unsigned int bits;
+    if (exp == 0x1f) {
+        bits = sign | 0x7f800000 | (mant << 13);
+    } else if (exp) {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    } else if (mant) {
+        // Subnormal, normalize it.
+        exp = 113;
+        while (!(mant & 0x400)) { mant <<= 1; exp--; }
+        bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    } else {
+        bits = sign;
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+unsigned short float_to_half(float f)
+{
+    unsigned int bits;
+    memcpy(&bits, &f, sizeof(bits));
+    unsigned short sign = (bits >> 16) & 0x8000;
+    int exp = ((bits >> 23) & 0xff) - 112;
+    unsigned int mant = bits & 0x7fffff;
+
+    if (((bits >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mant ? 0x200 : 0);
+    if (exp >= 0x1f) return sign | 0x7c00;
+    if (exp <= 0) {
+        if (exp < -10) return sign;
+        mant |= 0x800000;
+        int shift = 14 - exp;
+        unsigned int half = mant >> shift;
+        unsigned int rest = mant & ((1u << shift) - 1);
+        unsigned int mid = 1u << (shift - 1);
+        if (rest > mid || (rest == mid && (half & 1))) half++;
+        return sign | half;
+    }
+    unsigned int half = (exp << 10) | (mant >> 13);
+    unsigned int rest = mant & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+    return sign | half;
+}
+
+// Read one row of one channel as floats.
+void load_typed_row(typed_image im, int y, int c, float *out)
+{
+    int i, offset = im.w*(y + im.h*c);
+    switch (im.type) {
+        case PIXEL_U8: {
+            unsigned char *in = (unsigned char *)im.data + offset;
+            for (i = 0; i < im.w; i++) out[i] = in[i] * (1.f/255);
+            break;
+        }
+        case PIXEL_U16: {
+            unsigned short *in = (unsigned short *)im.data + offset;
+            for (i = 0; i < im.w; i++) out[i] = in[i] * (1.f/65535);
+            break;
+        }
+        case PIXEL_F16: {
+            unsigned short *in = (unsigned short *)im.data + offset;
+            for (i = 0; i < im.w; i++) out[i] = half_to_float(in[i]);
+            break;
+        }
+        default:
+            memcpy(out, (float *)im.data + offset, im.w*sizeof(float));
+    }
+}
+
+// Write one row of one channel from floats, saturating integer types.
+void store_typed_row(typed_image im, int y, int c, const float *in)
+{
+    int i, offset = im.w*(y + im.h*c);
+    switch (im.type) {
+        case PIXEL_U8: {
+            unsigned char *out = (unsigned char *)im.data + offset;
+            for (i = 0; i < im.w; i++) {
+                float v = in[i] * 255 + .5f;
+                out[i] = v < 0 ? 0 : (v > 255 ? 255 : (unsigned char)v);
+            }
+            break;
+        }
+        case PIXEL_U16: {
+            unsigned short *out = (unsigned short *)im.data + offset;
+            for (i = 0; i < im.w; i++) {
+                float v = in[i] * 65535 + .5f;
+                out[i] = v < 0 ? 0 : (v > 65535 ? 65535 : (unsigned short)v);
+            }
+            break;
+        }
+        case PIXEL_F16: {
+            unsigned short *out = (unsigned short *)im.data + offset;
+            for (i = 0; i < im.w; i++) out[i] = float_to_half(in[i]);
+            break;
+        }
+        default:
+            memcpy((float *)im.data + offset, in, im.w*sizeof(float));
+    }
+}
+
+// A few float rows of one channel of a typed image, keyed by row index.
+// Slot y % n holds row y, so any n consecutive rows can be live at once.
+typedef struct{
+    typed_image im;
+    int c, n;
+    int *ys;
+    float **rows;
+} row_cache;
+
+static row_cache make_row_cache(typed_image im, int n)
+{
+    row_cache rc;
+    rc.im = im;
+    rc.c = 0;
+    rc.n = n;
+    rc.ys = calloc(n, sizeof(int));
+    rc.rows = calloc(n, sizeof(float *));
+    for (int i = 0; i < n; i++) {
+        rc.ys[i] = -1;
+        rc.rows[i] = calloc(im.w, sizeof(float));
+    }
+    return rc;
+}
+
+static void set_row_cache_channel(row_cache *rc, int c)
+{
+    rc->c = c;
+    for (int i = 0; i < rc->n; i++) rc->ys[i] = -1;
+}
+
+static float *get_cached_row(row_cache *rc, int y)
+{
+    int slot = y % rc->n;
+    if (rc->ys[slot] != y) {
+        load_typed_row(rc->im, y, rc->c, rc->rows[slot]);
+        rc->ys[slot] = y;
+    }
+    return rc->rows[slot];
+}
+
+static void free_row_cache(row_cache rc)
+{
+    for (int i = 0; i < rc.n; i++) free(rc.rows[i]);
+    free(rc.rows);
+    free(rc.ys);
+}
+
+image typed_to_image(typed_image im)
+{
+    image out = make_image(im.w, im.h, im.c);
+    for (int c = 0; c < im.c; c++) {
+        for (int y = 0; y < im.h; y++) {
+            load_typed_row(im, y, c, image_row(out, y, c));
+        }
+    }
+    return out;
+}
+
+typed_image image_to_typed(image im, PIXEL_TYPE type)
+{
+    typed_image out = make_typed_image(im.w, im.h, im.c, type);
+    for (int c = 0; c < im.c; c++) {
+        for (int y = 0; y < im.h; y++) {
+            store_typed_row(out, y, c, image_row(im, y, c));
+        }
+    }
+    return out;
+}
+
+// Load an image straight into a typed buffer. 8-bit images skip float
+// entirely, stb's bytes are only reordered to planar.
+typed_image load_typed_image(char *filename, PIXEL_TYPE type)
+{
+    int w, h, c;
+    unsigned char *data = stbi_load(filename, &w, &h, &c, 0);
+    if (!data) {
+        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n",
+            filename, stbi_failure_reason());
+        exit(0);
+    }
+    //We don't like alpha channels, #YOLO
+    int oc = (c == 4) ? 3 : c;
+    typed_image im = make_typed_image(w, h, oc, type);
+    int i, k, plane = w*h;
+    if (type == PIXEL_U8) {
+        unsigned char *out = im.data;
+        for (i = 0; i < plane; i++) {
+            for (k = 0; k < oc; k++) out[i + k*plane] = data[i*c + k];
+        }
+    } else {
+        float *row = calloc(w, sizeof(float));
+        for (k = 0; k < oc; k++) {
+            for (int y = 0; y < h; y++) {
+                unsigned char *in = data + y*w*c + k;
+                for (i = 0; i < w; i++) row[i] = in[i*c] / 255.f;
+                store_typed_row(im, y, k, row);
+            }
+        }
+        free(row);
+    }
+    free(data);
+    return im;
+}
+
+typed_image resize_typed(typed_image im, int w, int h, int nn)
+{
+    typed_image out = make_typed_image(w, h, im.c, im.type);
+    row_cache rc = make_row_cache(im, 2);
+    float *row = calloc(w, sizeof(float));
+
+    float x_factor = 1. * im.w / w;
+    float x_shift = x_factor / 2.0 - 0.5;
+    float y_factor = 1. * im.h / h;
+    float y_shift = y_factor / 2.0 - 0.5;
+
+    for (int c = 0; c < im.c; c++) {
+        set_row_cache_channel(&rc, c);
+        for (int i = 0; i < h; i++) {
+            float y = y_factor * i + y_shift;
+            if (nn) {
+                float *in = get_cached_row(&rc, find_closest_int(y, im.h - 1));
+                for (int j = 0; j < w; j++) {
+                    row[j] = in[find_closest_int(x_factor * j + x_shift, im.w - 1)];
+                }
+            } else {
+                int y_int = floor(y);
+                float y_dec = y - y_int;
+                float *top = get_cached_row(&rc, clamp_index(y_int, im.h));
+                float *bottom = get_cached_row(&rc, clamp_index(y_int + 1, im.h));
+                for (int j = 0; j < w; j++) {
+                    float x = x_factor * j + x_shift;
+                    int x_int = floor(x);
+                    float x_dec = x - x_int;
+                    int left = clamp_index(x_int, im.w);
+                    int right = clamp_index(x_int + 1, im.w);
+                    row[j] = (1 - x_dec) * (1 - y_dec) * top[left]
+                            + x_dec * (1 - y_dec) * top[right]
+                            + (1 - x_dec) * y_dec * bottom[left]
+                            + x_dec * y_dec * bottom[right];
+                }
+            }
+            store_typed_row(out, i, c, row);
+        }
+    }
+    free(row);
+    free_row_cache(rc);
+    return out;
+}
+
+typed_image nn_resize_typed(typed_image im, int w, int h)
+{
+    return resize_typed(im, w, h, 1);
+}
+
+typed_image bilinear_resize_typed(typed_image im, int w, int h)
+{
+    return resize_typed(im, w, h, 0);
+}
+
+// 8 bit images with integer filters take a fixed point path. With integer
+// taps, 255 * sum(w * p/255) is exactly sum(w * p), so summing in 16 bit
+// lanes and saturating gives the same bytes as the float loop, as long as no
+// partial sum can leave the int16 range. That holds when 255 times the sum
+// of absolute taps feeding one output fits.
+
+typedef struct{
+    int offset;     // into the padded rows of a window, fy*pw + fx
+    short w;
+} fixed_tap;
+
+typedef struct{
+    typed_image im, out;
+    int fw, fh;
+    int merge;
+    fixed_tap **taps;   // nonzero taps for each list, one list per channel
+    int *ntaps;         // or a single list across channels when merging
+} fixed_args;
+
+void fixed_rows(void *, int, int);
+
+// Collect the nonzero taps of a filter if the fixed point path can run it.
+// returns: 1 and fills args->taps and args->ntaps, or 0.
+int make_fixed_taps(typed_image im, image filter, int merge, fixed_args *args)
+{
+    if (im.type != PIXEL_U8) return 0;
+    for (int i = 0; i < filter.w*filter.h*filter.c; i++) {
+        float v = filter.data[i];
+        if (fabsf(v) > 128 || v != (short)v) return 0;
+    }
+
+    int pw = im.w + filter.w - 1;
+    int lists = merge ? 1 : im.c;
+    int taps = filter.w*filter.h*(merge ? im.c : 1);
+    args->taps = calloc(lists, sizeof(fixed_tap *));
+    args->ntaps = calloc(lists, sizeof(int));
+    for (int l = 0; l < lists; l++) args->taps[l] = calloc(taps, sizeof(fixed_tap));
+
+    int fits = 1;
+    for (int c = 0; c < im.c; c++) {
+        int l = merge ? 0 : c;
+        int k = merge ? c : 0;
+        float *weights = image_row(filter, 0, (im.c == filter.c) ? c : 0);
+        for (int fy = 0; fy < filter.h; fy++) {
+            for (int fx = 0; fx < filter.w; fx++) {
+                short w = weights[fy*filter.w + fx];
+                if (!w) continue;
+                fixed_tap t = {(k*filter.h + fy)*pw + fx, w};
+                args->taps[l][args->ntaps[l]++] = t;
+            }
+        }
+    }
+    for (int l = 0; l < lists; l++) {
+        int sum = 0;
+        for (int i = 0; i < args->ntaps[l]; i++) sum += abs(args->taps[l][i].w);
+        if (sum * 255 > 32767) fits = 0;
+    }
+    if (!fits) {
+        for (int l = 0; l < lists; l++) free(args->taps[l]);
+        free(args->taps);
+        free(args->ntaps);
+    }
+    return fits;
+}
+
+// Sum one output row of the fixed point path and saturate it to bytes.
+// const short *pad: the rows of the window, each pw wide with the clamped
+//                   border included.
+void fixed_span(const short *pad, const fixed_tap *taps, int n, unsigned char *out, int w)
+{
+    int x = 0;
+#ifdef __SSE2__
+    for (; x + 16 <= w; x += 16) {
+        __m128i a0 = _mm_setzero_si128(), a1 = a0;
+        for (int i = 0; i < n; i++) {
+            const short *p = pad + taps[i].offset + x;
+            __m128i t = _mm_set1_epi16(taps[i].w);
+            a0 = _mm_add_epi16(a0, _mm_mullo_epi16(t, _mm_loadu_si128((const __m128i *)p)));
+            a1 = _mm_add_epi16(a1, _mm_mullo_epi16(t, _mm_loadu_si128((const __m128i *)(p + 8))));
+        }
+        _mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16(a0, a1));
+    }
+#endif
+    for (; x < w; x++) {
+        int sum = 0;
+        for (int i = 0; i < n; i++) sum += taps[i].w * pad[taps[i].offset + x];
+        out[x] = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
+    }
+}
+
+// Fixed point convolution of output rows [start, end), all channels stacked.
+void fixed_rows(void *ptr, int start, int end)
+{
+    fixed_args *args = ptr;
+    typed_image im = args->im;
+    int fw = args->fw, fh = args->fh;
+    int pw = im.w + fw - 1;
+    int n = args->merge ? im.c : 1;
+    short *pad = calloc(n*fh*pw, sizeof(short));
+
+    for (int r = start; r < end; r++) {
+        int c = r / im.h;
+        int h = r % im.h;
+        for (int k = 0; k < n; k++) {
+            int ic = args->merge ? k : c;
+            for (int fy = 0; fy < fh; fy++) {
+                int y = clamp_index(h - fh/2 + fy, im.h);
+                const unsigned char *src = (unsigned char *)im.data + im.w*(y + im.h*ic);
+                short *dst = pad + (k*fh + fy)*pw;
+                for (int i = 0; i < fw/2; i++) dst[i] = src[0];
+                for (int i = 0; i < im.w; i++) dst[i + fw/2] = src[i];
+                for (int i = im.w + fw/2; i < pw; i++) dst[i] = src[im.w - 1];
+            }
+        }
+        unsigned char *out = (unsigned char *)args->out.data + im.w*(h + im.h*c);
+        int l = args->merge ? 0 : c;
+        fixed_span(pad, args->taps[l], args->ntaps[l], out, im.w);
+    }
+    free(pad);
+}
+
+// Convolve a typed image with a float filter, accumulating in float.
+// Same semantics as convolve_image; with preserve = 0 the channels are
+// summed in float before the single rounding into the output type.
+// 8 bit images with small integer filters give the same result through
+// 16 bit fixed point.
+typed_image convolve_typed(typed_image im, image filter, int preserve)
+{
+    fixed_args fixed = {0};
+    if (make_fixed_taps(im, filter, !preserve, &fixed)) {
+        fixed.im = im;
+        fixed.out = make_typed_image(im.w, im.h, preserve ? im.c : 1, im.type);
+        fixed.fw = filter.w;
+        fixed.fh = filter.h;
+        fixed.merge = !preserve;
+        parallel_for(fixed.out.c * im.h, fixed_rows, &fixed);
+        for (int l = 0; l < (preserve ? im.c : 1); l++) free(fixed.taps[l]);
+        free(fixed.taps);
+        free(fixed.ntaps);
+        return fixed.out;
+    }
+
+    typed_image out = make_typed_image(im.w, im.h, preserve ? im.c : 1, im.type);
+    int shift_x = filter.w / 2;
+    int shift_y = filter.h / 2;
+
+    int *cols = calloc(im.w + filter.w, sizeof(int));
+    for (int x = 0; x < im.w + filter.w - 1; x++) {
+        cols[x] = clamp_index(x - shift_x, im.w);
+    }
+    row_cache rc = make_row_cache(im, filter.h);
+    float **rows = calloc(filter.h, sizeof(float *));
+    float *sums = calloc(im.w*im.h, sizeof(float));
+    float *row = calloc(im.w, sizeof(float));
+
+    for (int c = 0; c < im.c; c++) {
+        float *weights = image_row(filter, 0, (im.c == filter.c) ? c : 0);
+        set_row_cache_channel(&rc, c);
+        for (int h = 0; h < im.h; h++) {
+            for (int fy = 0; fy < filter.h; fy++) {
+                rows[fy] = get_cached_row(&rc, clamp_index(h - shift_y + fy, im.h));
+            }
+            float *acc = preserve ? row : sums + h*im.w;
+            for (int w = 0; w < im.w; w++) {
+                float sum = 0;
+                for (int fy = 0; fy < filter.h; fy++) {
+                    float *weight = weights + fy*filter.w;
+                    for (int fx = 0; fx < filter.w; fx++) {
+                        sum += rows[fy][cols[w + fx]] * weight[fx];
+                    }
+                }
+                acc[w] = preserve ? sum : acc[w] + sum;
+            }
+            if (preserve) store_typed_row(out, h, c, row);
+        }
+    }
+    if (!preserve) {
+        for (int h = 0; h < im.h; h++) store_typed_row(out, h, 0, sums + h*im.w);
+    }
+
+    free(row);
+    free(sums);
+    free(rows);
+    free(cols);
+    free_row_cache(rc);
+    return out;
+}
+
+int rgb_to_grayscale_simd(const float *, const float *, const float *, float *, int);
+int rgb_to_hsv_simd(float *, float *, float *, int);
+int hsv_to_rgb_simd(float *, float *, float *, int);
+void rgb_to_hsv_pixels(float *, float *, float *, int, int);
+void hsv_to_rgb_pixels(float *, float *, float *, int, int);
+
+typed_image rgb_to_grayscale_typed(typed_image im)
+{
+    assert(im.c == 3);
+    typed_image gray = make_typed_image(im.w, im.h, 1, im.type);
+    float *rgb = calloc(4*im.w, sizeof(float));
+    float *r = rgb, *g = rgb + im.w, *b = rgb + 2*im.w, *out = rgb + 3*im.w;
+    for (int y = 0; y < im.h; y++) {
+        load_typed_row(im, y, 0, r);
+        load_typed_row(im, y, 1, g);
+        load_typed_row(im, y, 2, b);
+        for (int i = rgb_to_grayscale_simd(r, g, b, out, im.w); i < im.w; i++) {
+            out[i] = 0.299f * r[i] + 0.587f * g[i] + 0.114f * b[i];
+        }
+        store_typed_row(gray, y, 0, out);
+    }
+    free(rgb);
+    return gray;
+}
+
+static void convert_typed_rows(typed_image im, int to_hsv)
+{
+    assert(im.c == 3);
+    float *rows = calloc(3*im.w, sizeof(float));
+    float *a = rows, *b = rows + im.w, *c = rows + 2*im.w;
+    for (int y = 0; y < im.h; y++) {
+        load_typed_row(im, y, 0, a);
+        load_typed_row(im, y, 1, b);
+        load_typed_row(im, y, 2, c);
+        int done = to_hsv ? rgb_to_hsv_simd(a, b, c, im.w) : hsv_to_rgb_simd(a, b, c, im.w);
+        if (to_hsv) rgb_to_hsv_pixels(a + done, b + done, c + done, 1, im.w - done);
+        else hsv_to_rgb_pixels(a + done, b + done, c + done, 1, im.w - done);
+        store_typed_row(im, y, 0, a);
+        store_typed_row(im, y, 1, b);
+        store_typed_row(im, y, 2, c);
+    }
+    free(rows);
+}
+
+void rgb_to_hsv_typed(typed_image im)
+{
+    convert_typed_rows(im, 1);
+}
+
+void hsv_to_rgb_typed(typed_image im)
+{
+    convert_typed_rows(im, 0);
+}
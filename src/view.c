@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "image.h"
+
+// Make a view covering a whole planar image.
+// image im: image to look at.
+// returns: view sharing im's memory.
+view image_view(image im)
+{
+    view v;
+    v.w = im.w;
+    v.h = im.h;
+    v.c = im.c;
+    v.xs = 1;
+    v.ys = im.w;
+    v.cs = im.w*im.h;
+    v.pw = im.w;
+    v.data = im.data;
+    return v;
+}
+
+// Restrict a view to a sub-rectangle, no pixels are copied.
+// view v: view to crop.
+// int x, y: top left corner of the rectangle in v.
+// int w, h: size of the rectangle.
+// returns: view of the rectangle, clipped to the bounds of v.
+view crop_view(view v, int x, int y, int w, int h)
+{
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    w = MAX(0, MIN(w, v.w - x));
+    h = MAX(0, MIN(h, v.h - y));
+
+    view crop = v;
+    crop.w = w;
+    crop.h = h;
+    // Padding only belongs to the crop if it reaches the right edge.
+    crop.pw = (x + w == v.w) ? v.pw - x : w;
+    crop.data = v.data + x*v.xs + y*v.ys;
+    return crop;
+}
+
+// Restrict a view to a single channel, no pixels are copied.
+// view v: view to restrict.
+// int c: channel to keep.
+// returns: single channel view.
+view channel_view(view v, int c)
+{
+    assert(c >= 0 && c < v.c);
+    view ch = v;
+    ch.c = 1;
+    ch.data = v.data + c*v.cs;
+    return ch;
+}
+
+float get_view_pixel(view v, int x, int y, int c)
+{
+    x = x < 0 ? 0 : (x >= v.w ? v.w - 1 : x);
+    y = y < 0 ? 0 : (y >= v.h ? v.h - 1 : y);
+    c = c < 0 ? 0 : (c >= v.c ? v.c - 1 : c);
+    return v.data[x*v.xs + y*v.ys + c*v.cs];
+}
+
+void set_view_pixel(view v, int x, int y, int c, float val)
+{
+    if (x < 0 || y < 0 || c < 0 || x >= v.w || y >= v.h || c >= v.c) return;
+    v.data[x*v.xs + y*v.ys + c*v.cs] = val;
+}
+
+// Copy pixels from one view into another.
+// view src: pixels to copy.
+// view dst: destination, only the overlapping w, h and c are written.
+void copy_view(view src, view dst)
+{
+    int w = MIN(src.w, dst.w);
+    int h = MIN(src.h, dst.h);
+    int c = MIN(src.c, dst.c);
+    for (int k = 0; k < c; k++) {
+        for (int y = 0; y < h; y++) {
+            float *s = src.data + y*src.ys + k*src.cs;
+            float *d = dst.data + y*dst.ys + k*dst.cs;
+            if (src.xs == 1 && dst.xs == 1) {
+                memmove(d, s, w*sizeof(float));
+            } else {
+                for (int x = 0; x < w; x++) {
+                    d[x*dst.xs] = s[x*src.xs];
+                }
+            }
+        }
+    }
+}
+
+// Materialize a view as a packed planar image.
+// view v: view to copy.
+// returns: new image with the contents of v.
+image view_to_image(view v)
+{
+    image im = make_image(v.w, v.h, v.c);
+    copy_view(v, image_view(im));
+    return im;
+}
+
+// Allocate a zeroed planar view with 64 byte aligned, padded rows.
+// int w, h, c: size of the view.
+// returns: view owning its memory, release with free_aligned_view.
+view make_aligned_view(int w, int h, int c)
+{
+    view v;
+    v.w = w;
+    v.h = h;
+    v.c = c;
+    v.xs = 1;
+    v.ys = (w + VIEW_ALIGN_FLOATS - 1) / VIEW_ALIGN_FLOATS * VIEW_ALIGN_FLOATS;
+    v.cs = v.ys*h;
+    v.pw = v.ys;
+    v.data = 0;
+    size_t bytes = (size_t)v.cs*c*sizeof(float);
+    if (bytes && posix_memalign((void **)&v.data, VIEW_ALIGN, bytes) == 0) {
+        memset(v.data, 0, bytes);
+    }
+    return v;
+}
+
+// Copy an image into a new aligned view.
+view image_to_aligned_view(image im)
+{
+    view v = make_aligned_view(im.w, im.h, im.c);
+    copy_view(image_view(im), v);
+    return v;
+}
+
+void free_aligned_view(view v)
+{
+    free(v.data);
+}
+
+// Whether every row of v starts on a VIEW_ALIGN boundary.
+int view_is_aligned(view v)
+{
+    return v.xs == 1 && ((uintptr_t)v.data % VIEW_ALIGN) == 0
+        && v.ys % VIEW_ALIGN_FLOATS == 0 && v.cs % VIEW_ALIGN_FLOATS == 0;
+}
+
+image get_channel(image im, int c)
+{
+    return view_to_image(channel_view(image_view(im), c));
+}